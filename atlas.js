@@ -0,0 +1,178 @@
+//
+// Packs the card images into one sprite atlas
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+// writes public/build/deck.png with one row per suit and the card backs in the last
+// column, plus deck.css and deck.json giving the offset of each card. run from
+// "npm run build", needs nothing beyond node itself.
+//
+
+const fs = require("fs");
+const path = require("path");
+const zlib = require("zlib");
+
+const imageDir = "public/images";
+const outputDir = "public/build";
+const ranks = ["2", "3", "4", "5", "6", "7", "8", "9", "X", "J", "Q", "K", "A"];
+const suits = ["C", "D", "H", "S"];
+const backs = ["Card_back_01", "Card_back_12"];
+const signature = Buffer.from([0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a]);
+const columns = ranks.length + 1;
+const rows = suits.length;
+
+function paeth(a, b, c) {
+  const p = a + b - c;
+  const pa = Math.abs(p - a);
+  const pb = Math.abs(p - b);
+  const pc = Math.abs(p - c);
+  return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+// returns {width, height, pixels} for an 8 bit RGBA non-interlaced png
+function decode(file) {
+  const data = fs.readFileSync(file);
+  if (!data.subarray(0, 8).equals(signature)) {
+    throw new Error(file + ": not a png");
+  }
+  let width = 0;
+  let height = 0;
+  const idat = [];
+  for (let pos = 8; pos < data.length;) {
+    const len = data.readUInt32BE(pos);
+    const type = data.toString("ascii", pos + 4, pos + 8);
+    const body = data.subarray(pos + 8, pos + 8 + len);
+    if (type === "IHDR") {
+      width = body.readUInt32BE(0);
+      height = body.readUInt32BE(4);
+      if (body[8] !== 8 || body[9] !== 6 || body[12] !== 0) {
+        throw new Error(file + ": expected 8 bit RGBA non-interlaced");
+      }
+    } else if (type === "IDAT") {
+      idat.push(body);
+    }
+    pos += len + 12;
+  }
+  const raw = zlib.inflateSync(Buffer.concat(idat));
+  const stride = width * 4;
+  const pixels = Buffer.alloc(stride * height);
+  for (let y = 0; y < height; y++) {
+    const filter = raw[y * (stride + 1)];
+    const line = raw.subarray(y * (stride + 1) + 1, (y + 1) * (stride + 1));
+    const out = y * stride;
+    for (let x = 0; x < stride; x++) {
+      const a = x >= 4 ? pixels[out + x - 4] : 0;
+      const b = y > 0 ? pixels[out + x - stride] : 0;
+      const c = (x >= 4 && y > 0) ? pixels[out + x - stride - 4] : 0;
+      let value = line[x];
+      switch (filter) {
+      case 1: value += a; break;
+      case 2: value += b; break;
+      case 3: value += (a + b) >> 1; break;
+      case 4: value += paeth(a, b, c); break;
+      }
+      pixels[out + x] = value & 0xff;
+    }
+  }
+  return {width, height, pixels};
+}
+
+const crcTable = [];
+for (let n = 0; n < 256; n++) {
+  let c = n;
+  for (let k = 0; k < 8; k++) {
+    c = (c & 1) ? 0xedb88320 ^ (c >>> 1) : c >>> 1;
+  }
+  crcTable[n] = c >>> 0;
+}
+
+function crc32(buffer) {
+  let c = 0xffffffff;
+  for (const b of buffer) {
+    c = crcTable[(c ^ b) & 0xff] ^ (c >>> 8);
+  }
+  return (c ^ 0xffffffff) >>> 0;
+}
+
+function chunk(type, body) {
+  const result = Buffer.alloc(body.length + 12);
+  result.writeUInt32BE(body.length, 0);
+  result.write(type, 4, "ascii");
+  body.copy(result, 8);
+  result.writeUInt32BE(crc32(result.subarray(4, 8 + body.length)), 8 + body.length);
+  return result;
+}
+
+// returns the png for the RGBA pixels, each line using the "up" filter
+function encode(width, height, pixels) {
+  const stride = width * 4;
+  const raw = Buffer.alloc((stride + 1) * height);
+  for (let y = 0; y < height; y++) {
+    raw[y * (stride + 1)] = 2;
+    for (let x = 0; x < stride; x++) {
+      const up = y > 0 ? pixels[(y - 1) * stride + x] : 0;
+      raw[y * (stride + 1) + 1 + x] = (pixels[y * stride + x] - up) & 0xff;
+    }
+  }
+  const header = Buffer.alloc(13);
+  header.writeUInt32BE(width, 0);
+  header.writeUInt32BE(height, 4);
+  header[8] = 8;
+  header[9] = 6;
+  return Buffer.concat([signature,
+                        chunk("IHDR", header),
+                        chunk("IDAT", zlib.deflateSync(raw, {level: 9})),
+                        chunk("IEND", Buffer.alloc(0))]);
+}
+
+// name to [column, row]
+const cells = {};
+suits.forEach((suit, row) => ranks.forEach((rank, col) => cells[rank + suit] = [col, row]));
+backs.forEach((back, row) => cells[back] = [ranks.length, row]);
+
+let cardWidth = 0;
+let cardHeight = 0;
+let atlas = null;
+for (const name of Object.keys(cells)) {
+  const file = path.join(imageDir, backs.includes(name) ? "" : "deck", name + ".png");
+  const image = decode(file);
+  if (atlas === null) {
+    cardWidth = image.width;
+    cardHeight = image.height;
+    atlas = Buffer.alloc(cardWidth * columns * cardHeight * rows * 4);
+  } else if (image.width !== cardWidth || image.height !== cardHeight) {
+    throw new Error(file + ": cards must all be the same size");
+  }
+  const [col, row] = cells[name];
+  const stride = cardWidth * columns * 4;
+  for (let y = 0; y < cardHeight; y++) {
+    image.pixels.copy(atlas, (row * cardHeight + y) * stride + col * cardWidth * 4,
+                      y * cardWidth * 4, (y + 1) * cardWidth * 4);
+  }
+}
+
+const png = encode(cardWidth * columns, cardHeight * rows, atlas);
+const version = crc32(png).toString(16);
+
+// percentages keep the offsets right at whatever size the card is drawn
+let css = `.card {
+  display: inline-block;
+  aspect-ratio: ${cardWidth} / ${cardHeight};
+  background-image: url("deck.png?v=${version}");
+  background-size: ${columns * 100}% ${rows * 100}%;
+}
+`;
+const map = {image: "deck.png", version, width: cardWidth, height: cardHeight, cards: {}};
+for (const name of Object.keys(cells)) {
+  const [col, row] = cells[name];
+  const x = (col * 100 / (columns - 1)).toFixed(4).replace(/\.?0+$/, "");
+  const y = (row * 100 / (rows - 1)).toFixed(4).replace(/\.?0+$/, "");
+  css += `.card-${name} { background-position: ${x}% ${y}%; }\n`;
+  map.cards[name] = {x: col * cardWidth, y: row * cardHeight};
+}
+
+fs.mkdirSync(outputDir, {recursive: true});
+fs.writeFileSync(path.join(outputDir, "deck.png"), png);
+fs.writeFileSync(path.join(outputDir, "deck.css"), css);
+fs.writeFileSync(path.join(outputDir, "deck.json"), JSON.stringify(map, null, 2) + "\n");
+console.log(`deck.png ${columns}x${rows} cards, ${png.length} bytes`);
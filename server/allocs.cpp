@@ -0,0 +1,207 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include "allocs.h"
+
+#if defined(ALLOC_STATS)
+
+#include <atomic>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include "metrics.h"
+
+static const int messageTypes = kZUnknown + 1;
+
+static const char *phaseNames[kPhases] = {"handle", "fanout", "other"};
+
+// one thread's totals, written only by that thread
+struct ThreadAllocs {
+  atomic<uint64_t> _scopes[kPhases][messageTypes];
+  atomic<uint64_t> _count[kPhases][messageTypes];
+  atomic<uint64_t> _bytes[kPhases][messageTypes];
+  ThreadAllocs *_next;
+};
+
+static atomic<ThreadAllocs *> allAllocs(nullptr);
+static thread_local ThreadAllocs *threadAllocs = nullptr;
+static thread_local AllocScope *currentScope = nullptr;
+
+// returns the calling thread's totals. uses calloc, as new would come straight back here
+static ThreadAllocs *local() {
+  if (threadAllocs == nullptr) {
+    void *block = calloc(1, sizeof(ThreadAllocs));
+    if (block == nullptr) {
+      abort();
+    }
+    ThreadAllocs *allocs = new (block) ThreadAllocs();
+    ThreadAllocs *head = allAllocs.load();
+    do {
+      allocs->_next = head;
+    } while (!allAllocs.compare_exchange_weak(head, allocs));
+    threadAllocs = allocs;
+  }
+  return threadAllocs;
+}
+
+static void add(atomic<uint64_t> &value, uint64_t n) {
+  value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void record(AllocPhase phase, MessageType type, uint64_t scopes, uint64_t count, uint64_t bytes) {
+  ThreadAllocs *allocs = local();
+  add(allocs->_scopes[phase][type], scopes);
+  add(allocs->_count[phase][type], count);
+  add(allocs->_bytes[phase][type], bytes);
+}
+
+AllocScope::AllocScope(MessageType type, AllocPhase phase) :
+  _outer(currentScope),
+  _type(type),
+  _phase(phase),
+  _count(0),
+  _bytes(0) {
+  currentScope = this;
+}
+
+AllocScope::~AllocScope() {
+  currentScope = _outer;
+  record(_phase, _type, 1, _count, _bytes);
+}
+
+void allocRecord(size_t size) {
+  AllocScope *scope = currentScope;
+  if (scope != nullptr) {
+    scope->_count++;
+    scope->_bytes += size;
+  } else {
+    record(kPhaseOther, kZUnknown, 0, 1, size);
+  }
+}
+
+// adds up every thread's totals
+static void totals(uint64_t scopes[kPhases][messageTypes], uint64_t count[kPhases][messageTypes],
+                   uint64_t bytes[kPhases][messageTypes]) {
+  for (int phase = 0; phase < kPhases; phase++) {
+    for (int type = 0; type < messageTypes; type++) {
+      scopes[phase][type] = count[phase][type] = bytes[phase][type] = 0;
+    }
+  }
+  for (ThreadAllocs *next = allAllocs.load(); next != nullptr; next = next->_next) {
+    for (int phase = 0; phase < kPhases; phase++) {
+      for (int type = 0; type < messageTypes; type++) {
+        scopes[phase][type] += next->_scopes[phase][type].load(memory_order_relaxed);
+        count[phase][type] += next->_count[phase][type].load(memory_order_relaxed);
+        bytes[phase][type] += next->_bytes[phase][type].load(memory_order_relaxed);
+      }
+    }
+  }
+}
+
+string allocText() {
+  uint64_t scopes[kPhases][messageTypes];
+  uint64_t count[kPhases][messageTypes];
+  uint64_t bytes[kPhases][messageTypes];
+  totals(scopes, count, bytes);
+
+  string result;
+  string allocated;
+  char line[200];
+  result.append("# HELP kibitzer_allocations_total Heap allocations by message type and phase.\n");
+  result.append("# TYPE kibitzer_allocations_total counter\n");
+  allocated.append("# HELP kibitzer_allocated_bytes_total Heap bytes allocated by message type and phase.\n");
+  allocated.append("# TYPE kibitzer_allocated_bytes_total counter\n");
+  for (int phase = 0; phase < kPhases; phase++) {
+    for (int type = 0; type < messageTypes; type++) {
+      if (count[phase][type] != 0) {
+        snprintf(line, sizeof(line), "kibitzer_allocations_total{phase=\"%s\",type=\"%s\"} %llu\n",
+                 phaseNames[phase], metricTypeName((MessageType)type), (unsigned long long)count[phase][type]);
+        result.append(line);
+        snprintf(line, sizeof(line), "kibitzer_allocated_bytes_total{phase=\"%s\",type=\"%s\"} %llu\n",
+                 phaseNames[phase], metricTypeName((MessageType)type), (unsigned long long)bytes[phase][type]);
+        allocated.append(line);
+      }
+    }
+  }
+  return result + allocated;
+}
+
+string allocReport() {
+  uint64_t scopes[kPhases][messageTypes];
+  uint64_t count[kPhases][messageTypes];
+  uint64_t bytes[kPhases][messageTypes];
+  totals(scopes, count, bytes);
+
+  string result;
+  char line[200];
+  for (int phase = 0; phase < kPhases; phase++) {
+    for (int type = 0; type < messageTypes; type++) {
+      if (count[phase][type] != 0) {
+        uint64_t n = scopes[phase][type];
+        snprintf(line, sizeof(line), "alloc %-6s %-8s n=%llu allocs=%llu bytes=%llu per message=%.1f/%.0fB\n",
+                 phaseNames[phase], metricTypeName((MessageType)type), (unsigned long long)n,
+                 (unsigned long long)count[phase][type], (unsigned long long)bytes[phase][type],
+                 n ? (double)count[phase][type] / n : 0.0, n ? (double)bytes[phase][type] / n : 0.0);
+        result.append(line);
+      }
+    }
+  }
+  return result;
+}
+
+// a failed allocation would throw, which -fno-exceptions turns into ending the process
+static void *allocate(size_t size) {
+  allocRecord(size);
+  void *result = malloc(size != 0 ? size : 1);
+  if (result == nullptr) {
+    abort();
+  }
+  return result;
+}
+
+void *operator new(size_t size) {
+  return allocate(size);
+}
+
+void *operator new[](size_t size) {
+  return allocate(size);
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+  allocRecord(size);
+  return malloc(size != 0 ? size : 1);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept {
+  allocRecord(size);
+  return malloc(size != 0 ? size : 1);
+}
+
+void operator delete(void *block) noexcept {
+  free(block);
+}
+
+void operator delete[](void *block) noexcept {
+  free(block);
+}
+
+void operator delete(void *block, size_t) noexcept {
+  free(block);
+}
+
+void operator delete[](void *block, size_t) noexcept {
+  free(block);
+}
+
+void operator delete(void *block, const nothrow_t &) noexcept {
+  free(block);
+}
+
+void operator delete[](void *block, const nothrow_t &) noexcept {
+  free(block);
+}
+
+#endif
@@ -0,0 +1,67 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <string>
+#include <stddef.h>
+#include "config.h"
+#include "message.h"
+
+using namespace std;
+
+//
+// allocation accounting, built with ./configure --enable-alloc-stats. operator new is
+// replaced to count every allocation, and malloc'd blocks are counted with allocRecord.
+// counts go to the innermost AllocScope of the allocating thread, or to "other". without
+// the option everything here compiles to nothing
+//
+
+enum AllocPhase {
+  kPhaseHandle,
+  kPhaseFanout,
+  kPhaseOther,
+  kPhases
+};
+
+#if defined(ALLOC_STATS)
+
+// attributes the thread's allocations to a message type and phase while alive
+struct AllocScope {
+  AllocScope(MessageType type, AllocPhase phase);
+  ~AllocScope();
+
+  // the type may only be known once the message has been parsed
+  void type(MessageType type) { _type = type; }
+
+  AllocScope *_outer;
+  MessageType _type;
+  AllocPhase _phase;
+  uint64_t _count;
+  uint64_t _bytes;
+};
+
+// counts an allocation made without operator new
+void allocRecord(size_t size);
+
+// the totals in the prometheus text format
+string allocText();
+
+// one line for each type and phase that allocated
+string allocReport();
+
+#else
+
+struct AllocScope {
+  AllocScope(MessageType, AllocPhase) {}
+  void type(MessageType) {}
+};
+
+inline void allocRecord(size_t) {}
+inline string allocText() { return ""; }
+inline string allocReport() { return ""; }
+
+#endif
@@ -0,0 +1,214 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include <algorithm>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "assets.h"
+#include "config.h"
+#include "utils.h"
+
+#if defined(HAVE_LIBBROTLIENC)
+#include <brotli/encode.h>
+#endif
+
+struct MimeType {
+  const char *_extension;
+  const char *_mime;
+  bool _compress;
+};
+
+static const MimeType mimeTypes[] = {
+  {".css", "text/css", true},
+  {".html", "text/html", true},
+  {".ico", "image/x-icon", false},
+  {".jpg", "image/jpeg", false},
+  {".js", "application/javascript", true},
+  {".json", "application/json", true},
+  {".map", "application/json", true},
+  {".png", "image/png", false},
+  {".svg", "image/svg+xml", true},
+  {".txt", "text/plain", true},
+};
+
+// assets below here keep their content for as long as they keep their name
+static const char *immutablePath = "images/";
+
+// served for the directory itself
+static const char *defaultFile = "index.html";
+
+// the deepest directory loaded, stopping symbolic links that loop
+static const int maxDepth = 16;
+
+static const MimeType *mimeType(const string &path) {
+  const MimeType *result = nullptr;
+  for (const MimeType &next : mimeTypes) {
+    size_t len = strlen(next._extension);
+    if (path.length() > len && path.compare(path.length() - len, len, next._extension) == 0) {
+      result = &next;
+      break;
+    }
+  }
+  return result;
+}
+
+// 64 bit FNV-1a of the contents, quoted with the encoding's suffix for use as an ETag
+static string contentHash(const string &body, const char *suffix = "") {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : body) {
+    hash = (hash ^ c) * 0x100000001b3ULL;
+  }
+  char result[32];
+  snprintf(result, sizeof(result), "\"%016llx%s\"", (unsigned long long)hash, suffix);
+  return result;
+}
+
+// returns the gzip encoding, or empty when it is no smaller
+static string gzip(const string &body) {
+  string result;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+    result.resize(deflateBound(&stream, body.length()));
+    stream.next_in = (Bytef *)body.data();
+    stream.avail_in = body.length();
+    stream.next_out = (Bytef *)&result[0];
+    stream.avail_out = result.length();
+    if (deflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out < body.length()) {
+      result.resize(stream.total_out);
+    } else {
+      result.clear();
+    }
+    deflateEnd(&stream);
+  }
+  return result;
+}
+
+// returns the brotli encoding, or empty when it is no smaller or unavailable
+static string brotli(const string &body) {
+  string result;
+#if defined(HAVE_LIBBROTLIENC)
+  size_t size = BrotliEncoderMaxCompressedSize(body.length());
+  if (size != 0) {
+    result.resize(size);
+    if (BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                              body.length(), (const uint8_t *)body.data(),
+                              &size, (uint8_t *)&result[0]) && size < body.length()) {
+      result.resize(size);
+    } else {
+      result.clear();
+    }
+  }
+#else
+  (void)body;
+#endif
+  return result;
+}
+
+// DT_DIR, DT_REG or another type for the entry, following symbolic links and asking the
+// file system when the directory listing doesn't say
+static int entryType(const string &path, const struct dirent *entry) {
+  int result = entry->d_type;
+  if (result == DT_UNKNOWN || result == DT_LNK) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+      result = DT_UNKNOWN;
+    } else if (S_ISDIR(info.st_mode)) {
+      result = DT_DIR;
+    } else if (S_ISREG(info.st_mode)) {
+      result = DT_REG;
+    } else {
+      result = DT_UNKNOWN;
+    }
+  }
+  return result;
+}
+
+static bool readFile(const string &path, string &body) {
+  bool result = false;
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp != nullptr) {
+    char buffer[16384];
+    size_t n;
+    body.clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+      body.append(buffer, n);
+    }
+    result = !ferror(fp);
+    fclose(fp);
+  }
+  return result;
+}
+
+const string &Asset::etag(const char *encoding) const {
+  const string *result = &_etag;
+  if (encoding == nullptr) {
+    // identity
+  } else if (strcmp(encoding, "br") == 0) {
+    result = &_brotliEtag;
+  } else if (strcmp(encoding, "gzip") == 0) {
+    result = &_gzipEtag;
+  }
+  return *result;
+}
+
+bool AssetCache::load(const string &root) {
+  _assets.clear();
+  return loadDir(root, "");
+}
+
+const Asset *AssetCache::find(const string &path) const {
+  // lws may hand over the path with or without the leading slash
+  size_t start = path.find_first_not_of('/');
+  string key = start == string::npos ? defaultFile : path.substr(start);
+  if (key.back() == '/') {
+    key.append(defaultFile);
+  }
+  auto it = _assets.find(key);
+  return it != _assets.end() ? &it->second : nullptr;
+}
+
+bool AssetCache::loadDir(const string &root, const string &dir) {
+  DIR *handle = opendir((root + "/" + dir).c_str());
+  bool result = (handle != nullptr);
+  if (result) {
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != nullptr) {
+      string name = entry->d_name;
+      string path = dir + name;
+      const MimeType *type = mimeType(name);
+      int kind = name[0] == '.' ? DT_UNKNOWN : entryType(root + "/" + path, entry);
+      if (name[0] == '.') {
+        // hidden, also skips . and ..
+      } else if (kind == DT_DIR) {
+        if (count(path.begin(), path.end(), '/') < maxDepth) {
+          loadDir(root, path + "/");
+        }
+      } else if (kind == DT_REG && type != nullptr) {
+        Asset &asset = _assets[path];
+        if (readFile(root + "/" + path, asset._body)) {
+          asset._mime = type->_mime;
+          asset._etag = contentHash(asset._body);
+          asset._immutable = (path.compare(0, strlen(immutablePath), immutablePath) == 0);
+          if (type->_compress) {
+            asset._gzip = gzip(asset._body);
+            asset._brotli = brotli(asset._body);
+            asset._gzipEtag = contentHash(asset._body, "-gz");
+            asset._brotliEtag = contentHash(asset._body, "-br");
+          }
+        } else {
+          log("failed to read asset: %s\n", path.c_str());
+          _assets.erase(path);
+        }
+      }
+    }
+    closedir(handle);
+  }
+  return result;
+}
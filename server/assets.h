@@ -0,0 +1,54 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+// a file from the public directory held in memory
+struct Asset {
+  Asset() : _mime(nullptr), _immutable(false) {}
+
+  // the file contents, with compressed variants when they are smaller
+  string _body;
+  string _gzip;
+  string _brotli;
+
+  // the quoted content hash for each variant, strong validators differ by encoding
+  string _etag;
+  string _gzipEtag;
+  string _brotliEtag;
+
+  // the validator for the variant sent with the content-encoding, nullptr for identity
+  const string &etag(const char *encoding) const;
+
+  const char *_mime;
+
+  // never changes under the same name, so clients need not revalidate
+  bool _immutable;
+};
+
+// the public directory loaded into memory, immutable once loaded
+struct AssetCache {
+  // loads every file below root, returns false when root could not be read
+  bool load(const string &root);
+
+  // returns the asset for the request path, or nullptr
+  const Asset *find(const string &path) const;
+
+  // the number of files
+  int size() const { return (int)_assets.size(); }
+
+private:
+  // add the files in dir, keyed by their path below root
+  bool loadDir(const string &root, const string &dir);
+
+  // path below root to file
+  unordered_map<string, Asset> _assets;
+};
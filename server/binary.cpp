@@ -0,0 +1,71 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include "binary.h"
+
+// the longest varint for 32 bits
+static const int maxVarint = 5;
+
+void BinaryWriter::cards(const Hand &hand) {
+  varint(hand.size());
+  _buffer.append(hand.toBinary());
+}
+
+void BinaryWriter::mask(uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    byte((value >> (i * 8)) & 0xff);
+  }
+}
+
+void BinaryWriter::text(const string &value) {
+  varint(value.length());
+  _buffer.append(value);
+}
+
+void BinaryWriter::varint(uint32_t value) {
+  while (value >= 0x80) {
+    byte((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  byte(value);
+}
+
+int BinaryReader::byte() {
+  int result;
+  if (_pos < _len) {
+    result = _data[_pos++];
+  } else {
+    _error = true;
+    result = 0;
+  }
+  return result;
+}
+
+uint32_t BinaryReader::varint() {
+  uint32_t result = 0;
+  bool more = true;
+  for (int i = 0; i < maxVarint && more && !_error; i++) {
+    int next = byte();
+    result |= (uint32_t)(next & 0x7f) << (i * 7);
+    more = (next & 0x80) != 0;
+  }
+  if (more) {
+    _error = true;
+  }
+  return result;
+}
+
+Hand BinaryReader::rest() {
+  size_t pos = _pos;
+  _pos = _len;
+  return pos < _len ? Hand(_data + pos, _len - pos) : Hand();
+}
+
+string BinaryReader::restText() {
+  size_t pos = _pos;
+  _pos = _len;
+  return pos < _len ? string((const char *)_data + pos, _len - pos) : string();
+}
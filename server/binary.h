@@ -0,0 +1,81 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <string>
+#include <stdint.h>
+#include "cards.h"
+
+using namespace std;
+
+//
+// the "was-bin" subprotocol
+//
+// every frame is binary and starts with a MessageType byte. cards are one byte holding
+// the Card enum value, numbers are unsigned LEB128 varints and text is a varint length
+// followed by UTF-8 bytes.
+//
+// client to server, after the type byte:
+//   kChat, kNicname, kShuffle   text to the end of the frame
+//   kExchange                   command byte ('Q' to offer), varint session id, cards to the end
+//   kJoin                       varint slot
+//   kPickup                     optional varint count
+//   kPutDown                    cards to the end of the frame
+//   kRoom                       optional varint room, counting from 1
+//   kDeal, kInit, kSkip, kSync  nothing
+//
+// server to client, game state ("cards") after the type byte:
+//   byte    flags, bit 0 set when the hand follows, bit 1 when the legal plays follow
+//   varint  turn session id + 1, zero for nobody
+//   byte    faceDown
+//   varint  pile size, then one byte per card
+//   varint  session id          when the hand follows
+//   8 bytes hand mask, bit n set for Card n, little endian, when the hand follows
+//   varint  play count          when the plays follow
+//   8 bytes mask of each play, as for the hand, when the plays follow
+//   text    message
+//   text    game
+//
+// game state is always a full snapshot, the "was-ws" deltas are not used. everything
+// else, including the game state announced by join, is sent as JSON text frames
+//
+
+static const int kBinaryHand = 1;
+static const int kBinaryPlays = 2;
+
+// appends compact binary fields
+struct BinaryWriter {
+  void byte(int value) { _buffer.push_back(static_cast<char>(value)); }
+  void cards(const Hand &hand);
+  void mask(uint64_t value);
+  void text(const string &value);
+  void varint(uint32_t value);
+
+  string _buffer;
+};
+
+// reads compact binary fields, remembering any overrun
+struct BinaryReader {
+  BinaryReader(const unsigned char *data, size_t len) : _data(data), _len(len), _pos(0), _error(false) {}
+
+  // whether everything has been read
+  bool empty() const { return _pos >= _len; }
+
+  int byte();
+  uint32_t varint();
+
+  // the cards up to the end of the frame
+  Hand rest();
+
+  // the text up to the end of the frame
+  string restText();
+
+  const unsigned char *_data;
+  size_t _len;
+  size_t _pos;
+  bool _error;
+};
@@ -4,7 +4,8 @@
 // Copyright(C) 2020 Chris Warren-Smith.
 //
 
-#include <map>
+#include <string.h>
+#include <time.h>
 #include "cards.h"
 
 static Card firstCard = k2c;
@@ -29,22 +30,52 @@ static const char *cardName(Card card) {
   return "XX";
 }
 
-static const map<string, Card> cardNames = {
-  {"2C", k2c}, {"2D", k2d}, {"2H", k2h}, {"2S", k2s},
-  {"3C", k3c}, {"3D", k3d}, {"3H", k3h}, {"3S", k3s},
-  {"4C", k4c}, {"4D", k4d}, {"4H", k4h}, {"4S", k4s},
-  {"5C", k5c}, {"5D", k5d}, {"5H", k5h}, {"5S", k5s},
-  {"6C", k6c}, {"6D", k6d}, {"6H", k6h}, {"6S", k6s},
-  {"7C", k7c}, {"7D", k7d}, {"7H", k7h}, {"7S", k7s},
-  {"8C", k8c}, {"8D", k8d}, {"8H", k8h}, {"8S", k8s},
-  {"9C", k9c}, {"9D", k9d}, {"9H", k9h}, {"9S", k9s},
-  {"XC", kXc}, {"XD", kXd}, {"XH", kXh}, {"XS", kXs},
-  {"JC", kjc}, {"JD", kjd}, {"JH", kjh}, {"JS", kjs},
-  {"QC", kqc}, {"QD", kqd}, {"QH", kqh}, {"QS", kqs},
-  {"KC", kkc}, {"KD", kkd}, {"KH", kkh}, {"KS", kks},
-  {"AC", kac}, {"AD", kad}, {"AH", kah}, {"AS", kas}
+// the range of characters used by card codes, faces 2 to X and suits C to S
+static const char lowFace = '2';
+static const char lowSuit = 'C';
+static const int faceRange = 'X' - lowFace + 1;
+static const int suitRange = 'S' - lowSuit + 1;
+
+// the faces and suits in Card order
+static constexpr char faceCodes[] = "23456789XJQKA";
+static constexpr char suitCodes[] = "CSHD";
+
+// the Card for each face and suit character, -1 for characters that aren't codes
+struct CardCodes {
+  signed char _cards[faceRange][suitRange];
 };
 
+static constexpr CardCodes cardCodes() {
+  CardCodes result {};
+  for (int face = 0; face < faceRange; face++) {
+    for (int suit = 0; suit < suitRange; suit++) {
+      result._cards[face][suit] = -1;
+    }
+  }
+  for (int face = 0; faceCodes[face] != '\0'; face++) {
+    for (int suit = 0; suitCodes[suit] != '\0'; suit++) {
+      result._cards[faceCodes[face] - lowFace][suitCodes[suit] - lowSuit] = (signed char)(face * 4 + suit);
+    }
+  }
+  return result;
+}
+
+static constexpr CardCodes codes = cardCodes();
+
+static_assert(codes._cards['Q' - lowFace]['H' - lowSuit] == kqh, "card codes");
+static_assert(codes._cards['X' - lowFace]['D' - lowSuit] == kXd, "card codes");
+
+bool toCard(char face, char suit, Card &card) {
+  unsigned row = (unsigned)(face - lowFace);
+  unsigned column = (unsigned)(suit - lowSuit);
+  bool result = false;
+  if (row < (unsigned)faceRange && column < (unsigned)suitRange && codes._cards[row][column] != -1) {
+    card = static_cast<Card>(codes._cards[row][column]);
+    result = true;
+  }
+  return result;
+}
+
 bool compare(const Card &c1, const Card &c2, CardRank rank) {
   int r1 = rank(c1);
   int r2 = rank(c2);
@@ -57,141 +88,137 @@ bool compare(const Card &c1, const Card &c2, CardRank rank) {
   return result;
 }
 
-Hand::Hand(const list<unique_ptr<string>> &cards) {
-  for (auto &&next : cards) {
-    if (cardNames.find(*next) != cardNames.end()) {
-      _cards.push_back(cardNames.at(*next));
+Hand::Hand(const unsigned char *cards, size_t count) :
+  _set(0),
+  _size(0) {
+  for (size_t i = 0; i < count; i++) {
+    if (cards[i] <= lastCard) {
+      add(static_cast<Card>(cards[i]));
     }
   }
 }
 
-void Hand::addAll(const Hand &hand) {
-  for (Card next : hand._cards) {
-    _cards.push_back(next);
+void Hand::add(const Card card) {
+  if (!(_set & cardBit(card))) {
+    _set |= cardBit(card);
+    _cards[_size++] = card;
+    changed();
   }
 }
 
-bool Hand::hasEqual(Card card, CardRank rank) const {
-  int value = rank(card);
-  bool result = false;
-  for (Card next : _cards) {
-    if (rank(next) == value) {
-      result = true;
-      break;
-    }
+void Hand::addAll(const Hand &hand) {
+  for (int i = 0; i < hand._size; i++) {
+    add(hand.card(i));
   }
-  return result;
 }
 
-bool Hand::hasHigher(Card card, int minCount, CardRank rank) const {
-  auto comparator = [&](const Card &c1, const Card &c2) {
-    return compare(c1, c2, rank);
-  };
-
-  map<Card, int, decltype(comparator)> counts(comparator);
-  int value = rank(card);
-
-  for (Card next : _cards) {
-    if (rank(next) > value) {
-      counts[next]++;
-    }
-  }
+void Hand::copy(const Hand &hand) {
+  _set = hand._set;
+  _size = hand._size;
+  memcpy(_cards, hand._cards, _size);
+  changed();
+}
 
-  bool found = false;
-  for (auto it = counts.cbegin(); it != counts.cend(); ++it) {
-    if ((*it).second >= minCount) {
-      found = true;
+bool Hand::hasHigher(CardSet higher, int minCount) const {
+  CardSet cards = _set & higher;
+  bool result = false;
+  if (minCount <= 1) {
+    result = cards != 0;
+  } else {
+    while (cards != 0 && !result) {
+      // the lowest face remaining
+      CardSet suits = faceSet(lowestCard(cards));
+      result = cardCount(cards & suits) >= minCount;
+      cards &= ~suits;
     }
   }
-  return found;
+  return result;
 }
 
-bool Hand::has(const Hand &hand) const {
-  bool result = true;
-  for (Card next : hand._cards) {
-    if (find(_cards.begin(), _cards.end(), next) == _cards.end()) {
-      result = false;
-      break;
-    }
+Hand Hand::from(int index) const {
+  Hand result;
+  for (int i = index; i < _size; i++) {
+    result.add(card(i));
   }
   return result;
 }
 
-bool Hand::isEqual(Card card, CardRank rank) const {
-  int value = rank(card);
-  bool result = true;
-  for (Card next : _cards) {
-    if (rank(next) != value) {
-      result = false;
-      break;
+Hand Hand::only(CardSet set) const {
+  Hand result;
+  for (int i = 0; i < _size; i++) {
+    if (set & cardBit(card(i))) {
+      result._cards[result._size++] = _cards[i];
     }
   }
+  result._set = _set & set;
   return result;
 }
 
 Card Hand::pop() {
-  Card card = _cards.back();
-  _cards.pop_back();
-  return card;
+  Card result = card(--_size);
+  _set &= ~cardBit(result);
+  changed();
+  return result;
 }
 
 void Hand::remove(const Hand &hand) {
-  vector<Card> newCards;
-  for (auto card: _cards) {
-    bool found = false;
-    for (auto inner : hand._cards) {
-      if (inner == card) {
-        found = true;
-        break;
+  CardSet removed = _set & hand._set;
+  if (removed) {
+    int size = 0;
+    for (int i = 0; i < _size; i++) {
+      if (!(removed & cardBit(card(i)))) {
+        _cards[size++] = _cards[i];
       }
     }
-    if (!found) {
-      newCards.push_back(card);
-    }
+    _size = size;
+    _set &= ~removed;
+    changed();
   }
-  _cards = newCards;
+}
+
+bool Hand::startsWith(const Hand &hand) const {
+  return hand._size <= _size && memcmp(hand._cards, _cards, hand._size) == 0;
 }
 
 void Hand::sort(CardRank rank) {
-  ::sort( _cards.begin(), _cards.end(), [&](const Card &c1, const Card &c2) {
-    return compare(c1, c2, rank);
+  ::sort(_cards, _cards + _size, [&](unsigned char c1, unsigned char c2) {
+    return compare(static_cast<Card>(c1), static_cast<Card>(c2), rank);
   });
+  changed();
 }
 
 void Hand::swap(int i, int j) {
-  Card card = _cards[j];
+  unsigned char card = _cards[j];
   _cards[j] = _cards[i];
   _cards[i] = card;
+  changed();
 }
 
-string Hand::toJson() const {
-  string json = "[";
-  bool next = false;
-  for (Card card : _cards) {
-    if (next) {
-      json.push_back(',');
-    } else {
-      next = true;
+const string &Hand::toJson() const {
+  if (_json.empty()) {
+    // each card is at most 5 characters, "XX",
+    _json.reserve(2 + _size * 5);
+    _json.push_back('[');
+    for (int i = 0; i < _size; i++) {
+      if (i > 0) {
+        _json.push_back(',');
+      }
+      _json.push_back('"');
+      _json.append(cardName(card(i)));
+      _json.push_back('"');
     }
-    json.push_back('"');
-    json.append(cardName(card));
-    json.push_back('"');
+    _json.push_back(']');
   }
-  json.push_back(']');
-  return json;
+  return _json;
 }
 
 string Hand::toString() const {
   string result;
-  vector<Card> newCards;
-  bool next = false;
-  for (auto card: _cards) {
-    if (next) {
+  for (int i = 0; i < _size; i++) {
+    if (i > 0) {
       result.append(" ");
-    } else {
-      next = true;
     }
-    result.append(cardName(card));
+    result.append(cardName(card(i)));
   }
   if (result.length() == 0) {
     result.append("empty!");
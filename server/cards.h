@@ -6,11 +6,10 @@
 
 #pragma once
 
-#include <list>
 #include <string>
 #include <vector>
-#include <memory>
 #include <algorithm>
+#include <stdint.h>
 
 using namespace std;
 
@@ -32,44 +31,72 @@ enum Card {
 
 typedef int (*CardRank)(Card card);
 
-// a hand of cards
+// a set of cards, one bit per Card
+typedef uint64_t CardSet;
+
+// the number of cards in the deck
+static const int deckSize = 52;
+
+// the set holding only the given card
+constexpr CardSet cardBit(Card card) { return (CardSet)1 << card; }
+
+// the four suits of the card's face. each ranking values a face the same in every suit
+constexpr CardSet faceSet(Card card) { return (CardSet)0xF << (card & ~3); }
+
+// the number of cards in the set
+constexpr int cardCount(CardSet set) { return __builtin_popcountll(set); }
+
+// the lowest card in a non-empty set
+constexpr Card lowestCard(CardSet set) { return static_cast<Card>(__builtin_ctzll(set)); }
+
+// the card for a two character code such as "QH", returns false for anything else
+bool toCard(char face, char suit, Card &card);
+
+// a hand of cards, held once each. the set answers the rule queries while the
+// cards are kept in the order shown to the player
 struct Hand {
-  Hand() {}
+  Hand() : _set(0), _size(0) {}
   Hand(const Hand &hand) {
-    _cards = hand._cards;
+    copy(hand);
   }
-  Hand(const list<unique_ptr<string>> &cards);
+  Hand(const unsigned char *cards, size_t count);
 
   Hand& operator=(const Hand &hand) {
-    _cards = hand._cards;
+    copy(hand);
     return *this;
   }
 
   virtual ~Hand() {}
 
-  // add the card to the hand
-  void add(const Card card) { _cards.push_back(card); }
+  // add the card to the hand, unless it's already held
+  void add(const Card card);
 
   // add all the cards to the hand
   void addAll(const Hand &hand);
 
   // clear the hand
-  void clear() { _cards.clear(); }
+  void clear() { _set = 0; _size = 0; changed(); }
 
   // whether the hand has an equal value card
-  bool hasEqual(Card card, CardRank rank) const;
+  bool hasEqual(Card card) const { return (_set & faceSet(card)) != 0; }
 
-  // whether the hand has the minimum number of an higher value card
-  bool hasHigher(Card card, int minCount, CardRank rank) const;
+  // whether the hand has the minimum number of one face among the given higher cards
+  bool hasHigher(CardSet higher, int minCount) const;
 
   // whether the hand has all the cards of the given hand
-  bool has(const Hand &hand) const;
+  bool has(const Hand &hand) const { return (hand._set & ~_set) == 0; }
 
   // whether the hand has only equal value cards
-  bool isEqual(Card card, CardRank rank) const;
+  bool isEqual(Card card) const { return (_set & ~faceSet(card)) == 0; }
+
+  // returns the cards from the given position onwards
+  Hand from(int index) const;
+
+  // returns the cards also in the given set, in hand order
+  Hand only(CardSet set) const;
 
   // peek the last card from the hand
-  Card peek() const { return _cards.back(); }
+  Card peek() const { return card(_size - 1); }
 
   // pop the last card from the hand
   Card pop();
@@ -78,7 +105,10 @@ struct Hand {
   void remove(const Hand &hand);
 
   // the number of cards in the hand
-  int size() const { return _cards.size(); }
+  int size() const { return _size; }
+
+  // whether the hand begins with the cards of the given hand, in the same order
+  bool startsWith(const Hand &hand) const;
 
   // sort the cards
   void sort(CardRank rank);
@@ -86,14 +116,36 @@ struct Hand {
   // swaps the cards in the given positions
   void swap(int i, int j);
 
-  // returns the JSON string for the hand
-  string toJson() const;
+  // returns one byte per card, in hand order
+  string toBinary() const { return string((const char *)_cards, _size); }
+
+  // returns the JSON string for the hand, cached until the hand changes
+  const string &toJson() const;
+
+  // returns the hand as a set of bits indexed by Card
+  CardSet toMask() const { return _set; }
 
   // returns the hand as text
   string toString() const;
 
 private:
-  vector<Card> _cards;
+  // the card in the given position
+  Card card(int index) const { return static_cast<Card>(_cards[index]); }
+
+  // drop the cached JSON
+  void changed() { _json.clear(); }
+
+  // copy the given hand's cards
+  void copy(const Hand &hand);
+
+  CardSet _set;
+
+  // the cards in hand order
+  unsigned char _cards[deckSize];
+  int _size;
+
+  // the JSON for the cards, empty until requested
+  mutable string _json;
 };
 
 // the deck of cards
@@ -113,14 +165,17 @@ struct Deck {
   // deal out the suffled deck making n-hands of n-cards
   void deal(Hand &hand, int cards);
 
+  // the discard pile
+  const Hand &discard() const { return _discard; }
+
   // the size of the discard pile
   int discardSize() const { return _discard.size(); }
 
   // returns the json representation of the pack
-  string getPack() const { return _pack.toJson(); }
+  const string &getPack() const { return _pack.toJson(); }
 
   // returns the json representation of the dicard pile
-  string getDiscard() const { return _discard.toJson(); }
+  const string &getDiscard() const { return _discard.toJson(); }
 
   // the last card on the pile
   Card lastPlay() const { return static_cast<Card>(_last); }
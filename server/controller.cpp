@@ -5,42 +5,43 @@
 //
 
 #include <algorithm>
-#include <sstream>
+#include <atomic>
 #include <iostream>
-#include <map>
 #include <limits.h>
+#include <mutex>
+#include <string.h>
+#include "allocs.h"
+#include "binary.h"
 #include "controller.h"
+#include "json.h"
+#include "metrics.h"
+#include "trace.h"
 #include "utils.h"
+#include "watchdog.h"
 #include "config.h"
 
-static int nextId = 1;
+static atomic<int> nextId(1);
 static size_t cmdSize = 5;
 static int maxPlayers = 6;
 
-static const map<string, MessageType> messageTypes = {
-  {"chat:", kChat},
-  {"deal:", kDeal},
-  {"exch:", kExchange},
-  {"init:", kInit},
-  {"join:", kJoin},
-  {"nicn:", kNicname},
-  {"picu:", kPickup},
-  {"putd:", kPutDown},
-  {"room:", kRoom},
-  {"shuf:", kShuffle},
-  {"skip:", kSkip}
-};
+// the five byte command prefix as an integer
+static constexpr uint64_t command(const char *prefix) {
+  return (uint64_t)(unsigned char)prefix[0] | (uint64_t)(unsigned char)prefix[1] << 8 |
+    (uint64_t)(unsigned char)prefix[2] << 16 | (uint64_t)(unsigned char)prefix[3] << 24 |
+    (uint64_t)(unsigned char)prefix[4] << 32;
+}
 
-static list<unique_ptr<string>> toArray(const string &str) {
-  list<unique_ptr<string>> result;
+// reads a JSON array of card codes into the hand, skipping unknown cards
+static bool toHand(const char *data, size_t len, Hand &hand) {
+  TraceSpan span("parse");
   int brackets = 0;
   int start = -1;
   bool quotes = false;
   bool escape = false;
   bool error = false;
 
-  for (size_t i = 0; i < str.size() && !error; i++) {
-    switch (str[i]) {
+  for (size_t i = 0; i < len && !error; i++) {
+    switch (data[i]) {
     case '[':
       if (!escape) {
         brackets++;
@@ -69,8 +70,10 @@ static list<unique_ptr<string>> toArray(const string &str) {
         } else if (brackets < 1 || start < 0) {
           error = true;
         } else {
-          string s = str.substr(start, i - start);
-          result.push_back(make_unique<string>(s));
+          Card card;
+          if (i - start == 2 && toCard(data[start], data[start + 1], card)) {
+            hand.add(card);
+          }
         }
       }
       escape = false;
@@ -83,28 +86,31 @@ static list<unique_ptr<string>> toArray(const string &str) {
     }
   }
   if (error) {
-    log("error in list %s\n", str.c_str());
+    log("error in list %.*s\n", (int)len, data);
   }
-  return result;
+  return !error;
 }
 
-int toInt(const string &str) {
+int toInt(const char *data, size_t len) {
   int result = 0;
-  int index = 0;
-  while (str[index] == ' ') {
+  size_t index = 0;
+  while (index < len && data[index] == ' ') {
     index++;
   }
-  while (isdigit(str[index])) {
-    result = (result * 10) + (str[index] - '0');
+  while (index < len && isdigit(data[index])) {
+    result = (result * 10) + (data[index] - '0');
     index++;
   }
   return result;
 }
 
+int toInt(const string &str) {
+  return toInt(str.data(), str.length());
+}
+
 const string fromInt(int value) {
   char num[12];
-  sprintf(num, "%d", value);
-  return num;
+  return string(num, formatInt(num, value));
 }
 
 const string field(const string &name, const string &value, bool next = false) {
@@ -114,14 +120,22 @@ const string field(const string &name, const string &value, bool next = false) {
   }
   result.push_back('\"');
   result.append(name);
-  if (value[0] == '[' || value[0] == '{' || value == "true" || value == "false") {
-    result.append("\":");
-    result.append(value);
-  } else {
-    result.append("\":\"");
-    result.append(value);
-    result.push_back('\"');
+  result.append("\":\"");
+  jsonEscape(result, value.data(), value.length());
+  result.push_back('\"');
+  return result;
+}
+
+// the field with a value that's already JSON
+const string fieldJson(const string &name, const string &json, bool next = false) {
+  string result;
+  if (next) {
+    result.push_back(',');
   }
+  result.push_back('\"');
+  result.append(name);
+  result.append("\":");
+  result.append(json);
   return result;
 }
 
@@ -141,24 +155,53 @@ const string envelope(const string &id, const string &data) {
   string result;
   result.push_back('{');
   result.append(field("id", id, false));
-  result.append(field("data", data, true));
+  result.append(fieldJson("data", data, true));
   result.push_back('}');
   return result;
 }
 
 const string escape(const string &str) {
   string result;
-  for (char c : str) {
-    if (c == '"') {
-      result.push_back('\\');
+  jsonEscape(result, str.data(), str.length());
+  return result;
+}
+
+// appends the cards found in any play and each play, as card masks like the binary protocol
+static void playsJson(JsonWriter &json, const Plays &plays) {
+  json.raw(",\"playable\":", 12);
+  json.number(plays.playable());
+  json.raw(",\"plays\":[", 10);
+  for (int i = 0; i < plays._count; i++) {
+    if (i > 0) {
+      json.raw(',');
     }
-    result.push_back(c);
+    json.number(plays._plays[i]);
   }
-  return result;
+  json.raw(']');
+}
+
+// appends the start of a delta envelope
+static void openDelta(JsonWriter &json, int version, int base, const string &message, int turn) {
+  json.raw('{');
+  json.field("id", "delta", false);
+  json.raw(",\"data\":{", 9);
+  json.field("version", version, false);
+  json.field("base", base, true);
+  json.field("message", message, true);
+  json.field("turn", turn, true);
 }
 
 const string message(const string &str) {
-  return envelope("message", str);
+  return envelope("message", "\"" + escape(str) + "\"");
+}
+
+// the message envelope written straight into a frame
+static Frame *messageFrame(const string &str) {
+  JsonWriter json(str.length() + 32);
+  json.raw("{\"id\":\"message\",\"data\":", 23);
+  json.text(str);
+  json.raw('}');
+  return json.frame();
 }
 
 const string player(int sessionId, bool active, const string &nicname) {
@@ -195,7 +238,10 @@ Player::Player(int sessionId) :
   _sessionId(sessionId),
   _points(0),
   _room(0),
-  _state(kLurk) {
+  _state(kLurk),
+  _binary(false),
+  _deltas(false),
+  _version(0) {
   _nicname = "#" + fromInt(sessionId);
 }
 
@@ -203,9 +249,138 @@ const string Player::toJson() const {
   return ::player(_sessionId, (_state != kLurk && _slot != -1), _nicname);
 }
 
+static string fold(const string &nicname) {
+  string result;
+  result.reserve(nicname.length());
+  for (char c : nicname) {
+    result.push_back(tolower(c));
+  }
+  return result;
+}
+
+// case folded nicnames to session ids, shared by every shard's controller so names stay
+// unique across the server, and held while a player is handed between shards. split by
+// hash so that shards renaming at once rarely meet on the same lock
+struct NicStripe {
+  mutex _lock;
+  unordered_map<string, int> _owners;
+};
+static const int nicStripes = 16;
+static NicStripe nicnames[nicStripes];
+
+// the stripe holding the case folded nicname
+static NicStripe &nicStripe(const string &folded) {
+  return nicnames[hash<string>()(folded) % nicStripes];
+}
+
+// whether the nicname is a session's own #id, unique without the registry
+static bool defaultNic(const string &nicname) {
+  return !nicname.empty() && nicname[0] == '#';
+}
+
+// claims the nicname for the session, false when another session holds it. connecting
+// players keep their #id and take no lock
+static bool claimNic(const string &nicname, int sessionId) {
+  bool result;
+  if (defaultNic(nicname)) {
+    result = (nicname == "#" + fromInt(sessionId));
+  } else {
+    string folded = fold(nicname);
+    NicStripe &stripe = nicStripe(folded);
+    lock_guard<mutex> lock(stripe._lock);
+    result = (stripe._owners.emplace(folded, sessionId).first->second == sessionId);
+  }
+  return result;
+}
+
+// releases the nicname when held by the session
+static void releaseNic(const string &nicname, int sessionId) {
+  if (!defaultNic(nicname)) {
+    string folded = fold(nicname);
+    NicStripe &stripe = nicStripe(folded);
+    lock_guard<mutex> lock(stripe._lock);
+    auto it = stripe._owners.find(folded);
+    if (it != stripe._owners.end() && it->second == sessionId) {
+      stripe._owners.erase(it);
+    }
+  }
+}
+
+// the session holding the nicname, otherwise -1
+static int nicOwner(const string &nicname) {
+  int result = -1;
+  if (defaultNic(nicname)) {
+    int sessionId = toInt(nicname.data() + 1, nicname.length() - 1);
+    result = (nicname == "#" + fromInt(sessionId)) ? sessionId : -1;
+  } else {
+    string folded = fold(nicname);
+    NicStripe &stripe = nicStripe(folded);
+    lock_guard<mutex> lock(stripe._lock);
+    auto it = stripe._owners.find(folded);
+    result = it != stripe._owners.end() ? it->second : -1;
+  }
+  return result;
+}
+
+Player *Players::add(const Player &player) {
+  int slot;
+  if (_free.empty()) {
+    slot = _pool.size();
+    _pool.push_back(make_unique<Player>(player));
+  } else {
+    slot = _free.back();
+    _free.pop_back();
+    *_pool[slot] = player;
+  }
+  _index[player._sessionId] = slot;
+  Player *result = _pool[slot].get();
+  if (!claimNic(result->_nicname, result->_sessionId)) {
+    // taken while the player was away, fall back to the session's own name
+    log("nicname taken: [%d] %s\n", result->_sessionId, result->_nicname.c_str());
+    result->_nicname = "#" + fromInt(result->_sessionId);
+    claimNic(result->_nicname, result->_sessionId);
+  }
+  return result;
+}
+
+Player *Players::find(int sessionId) const {
+  auto it = _index.find(sessionId);
+  return it != _index.end() ? _pool[it->second].get() : nullptr;
+}
+
+Player *Players::findNic(const string &nicname) const {
+  return find(nicOwner(nicname));
+}
+
+void Players::remove(int sessionId, bool keepNic) {
+  auto it = _index.find(sessionId);
+  if (it != _index.end()) {
+    Player *player = _pool[it->second].get();
+    if (!keepNic) {
+      releaseNic(player->_nicname, sessionId);
+    }
+    player->_hand.clear();
+    _free.push_back(it->second);
+    _index.erase(it);
+  }
+}
+
+bool Players::rename(Player *player, const string &nicname) {
+  bool result = claimNic(nicname, player->_sessionId);
+  if (result) {
+    if (fold(nicname) != fold(player->_nicname)) {
+      releaseNic(player->_nicname, player->_sessionId);
+    }
+    player->_nicname = nicname;
+  }
+  return result;
+}
+
 Room::Room() :
   _rules(nullptr),
-  _turn(-1) {
+  _turn(-1),
+  _version(1),
+  _pileReset(false) {
   for (int i = 0; i < maxPlayers; i++) {
     _slots.push_back(-1);
   }
@@ -219,32 +394,46 @@ Controller::Controller() {
   _rooms[numRooms - 1]._rules = getRules(kRulesFree);
 }
 
+void Controller::attach(const Player &player) {
+  log("attach session: [%d]\n", player._sessionId);
+  _players.add(player);
+}
+
 int Controller::createSession() {
-  int sessionId = nextId++;
-  log("create session: [%d]\n", sessionId);
-  _players.push_back(make_unique<Player>(sessionId));
+  int sessionId = nextSessionId();
+  createSession(sessionId);
   return sessionId;
 }
 
+void Controller::createSession(int sessionId, bool binary) {
+  log("create session: [%d]\n", sessionId);
+  Player *player = _players.add(Player(sessionId));
+  player->_binary = binary;
+  _rooms[0]._members.push_back(sessionId);
+  metricRoom(0, 1);
+}
+
 const Message Controller::destroySession(int sessionId) {
   Message result;
-  auto player = findSession(sessionId);
-  if (player != _players.end()) {
-    int room = (*player)->_room;
-    int slot = (*player)->_slot;
+  Player *player = findSession(sessionId);
+  if (player != nullptr) {
+    int room = player->_room;
+    int slot = player->_slot;
     if (slot > -1 && slot < slots(room)) {
       // free the game slot
       _rooms[room]._slots[slot] = -1;
     }
 
-    string name = (*player)->name();
-    string playersJson = players((*player)->_room);
-    _players.erase(remove(_players.begin(), _players.end(), *player));
+    leave(room, sessionId);
+
+    string name = player->name();
+    string playersJson = players(player->_room);
+    _players.remove(sessionId);
 
     string json;
     json.push_back('{');
     json.append(field("id", sessionId, false));
-    json.append(field("players", playersJson, true));
+    json.append(fieldJson("players", playersJson, true));
     json.append(field("name", name, true));
     json.push_back('}');
     result.build(envelope("exit", json), kChat);
@@ -256,56 +445,92 @@ const Message Controller::destroySession(int sessionId) {
   return result;
 }
 
+bool Controller::detach(int sessionId, Player &player) {
+  Player *current = findSession(sessionId);
+  bool result = (current != nullptr);
+  if (result) {
+    int room = current->_room;
+    if (current->_slot > -1 && current->_slot < slots(room)) {
+      _rooms[room]._slots[current->_slot] = -1;
+    }
+    leave(room, sessionId);
+    player = *current;
+    player._slot = -1;
+    // the nicname stays claimed until the player is attached elsewhere
+    _players.remove(sessionId, true);
+    log("detach session: [%d]\n", sessionId);
+  }
+  return result;
+}
+
 bool Controller::handle(const string data, Message &response, int sessionId) {
   return handle((const unsigned char *)data.c_str(), data.length(), response, sessionId);
 }
 
 bool Controller::handle(const unsigned char *data, size_t len, Message &response, int sessionId) {
-  auto player = findSession(sessionId);
+  TraceSpan span("handle", sessionId);
+  AllocScope allocs(kZUnknown, kPhaseHandle);
+  Player *player = findSession(sessionId);
+  uint64_t start = metricNow();
+  MessageType type = kZUnknown;
   bool result = true;
-  if (player != _players.end() && len >= cmdSize) {
-    string *message = new string((const char *)data, len);
+  if (player != nullptr && player->_binary && len > 0) {
+    type = data[0] < kZUnknown ? (MessageType)data[0] : kZUnknown;
+    allocs.type(type);
+    watchWork(type, player->_room, sessionId);
+    metricReceived(type);
+    response.broadcast("");
+    result = handleBinary(response, player, data, len);
+  } else if (player != nullptr && len >= cmdSize) {
+    // the arguments follow the command
+    const char *args = (const char *)data + cmdSize;
+    size_t argsLen = len - cmdSize;
     response.broadcast("");
-    MessageType type = getMessageType(message->substr(0, cmdSize));
+    type = getMessageType(data);
+    allocs.type(type);
+    watchWork(type, player->_room, sessionId);
+    metricReceived(type);
     switch (type) {
     case kChat:
-      result = chat(response, *player, message->substr(cmdSize));
+      result = chat(response, player, string(args, argsLen));
       break;
     case kDeal:
-      result = deal(response, *player);
+      result = deal(response, player);
       break;
     case kExchange:
-      result = exchange(response, *player, message->substr(cmdSize));
+      result = exchange(response, player, args, argsLen);
       break;
     case kInit:
-      result = init(response, *player);
+      result = init(response, player);
       break;
     case kJoin:
-      result = join(response, *player, message->substr(cmdSize));
+      result = join(response, player, string(args, argsLen));
       break;
     case kNicname:
-      result = nic(response, *player, message->substr(cmdSize));
+      result = nic(response, player, string(args, argsLen));
       break;
     case kPickup:
-      result = pickup(response, *player, message->substr(cmdSize));
+      result = pickup(response, player, string(args, argsLen));
       break;
     case kPutDown:
-      result = putdown(response, *player, Hand(toArray(message->substr(cmdSize))));
+      result = putdown(response, player, args, argsLen);
       break;
     case kRoom:
-      result = room(response, *player, message->substr(cmdSize));
+      result = room(response, player, string(args, argsLen));
       break;
     case kShuffle:
-      result = shuffle(response, *player, message->substr(cmdSize));
+      result = shuffle(response, player, string(args, argsLen));
       break;
     case kSkip:
-      result = skip(response, *player);
+      result = skip(response, player);
+      break;
+    case kSync:
+      result = sync(response, player);
       break;
     default:
-      log("invalid message: %s", message->c_str());
+      log("invalid message: %.*s\n", (int)len, (const char *)data);
       break;
     }
-    delete message;
   } else if (len < 4) {
     log("invalid message\n");
     result = false;
@@ -313,18 +538,39 @@ bool Controller::handle(const unsigned char *data, size_t len, Message &response
     log("session not found: [%d]\n", sessionId);
     result = false;
   }
+  metricHandled(type, metricNow() - start);
   return result;
 }
 
-bool Controller::isSameRoom(int session1, int session2) {
-  auto player1 = findSession(session1);
-  auto player2 = findSession(session2);
-  return player1 != _players.end() && player2 != _players.end() && (*player1)->_room == (*player2)->_room;
+const vector<int> &Controller::members(int sessionId) {
+  static const vector<int> none;
+  Player *player = findSession(sessionId);
+  return player != nullptr ? _rooms[player->_room]._members : none;
+}
+
+int Controller::requestedRoom(const unsigned char *data, size_t len, bool binary) {
+  int result = -1;
+  if (binary) {
+    if (len > 1 && data[0] == kRoom) {
+      BinaryReader reader(data + 1, len - 1);
+      int room = (int)reader.varint() - 1;
+      if (!reader._error && room >= 0 && room < numRooms) {
+        result = room;
+      }
+    }
+  } else if (len > cmdSize && getMessageType(data) == kRoom) {
+    int room = toInt((const char *)data + cmdSize, len - cmdSize) - 1;
+    if (room >= 0 && room < numRooms) {
+      result = room;
+    }
+  }
+  return result;
 }
 
 const Message Controller::redact(int sessionId, const Message &message) {
+  TraceSpan span("redact", sessionId);
   Message result;
-  auto player = findSession(sessionId);
+  Player *player = findSession(sessionId);
 
   switch (message._type) {
   case kDeal:
@@ -332,8 +578,8 @@ const Message Controller::redact(int sessionId, const Message &message) {
   case kPickup:
   case kPutDown:
   case kSkip:
-    if (player != _players.end()) {
-      result.build(cards(*player, (*player)->_room, message.broadcast()), message._type);
+    if (player != nullptr) {
+      cards(result, player, player, player->_room, message.broadcast(), message._type);
     } else {
       result.build(cards(nullptr, 0, message.broadcast()), message._type);
     }
@@ -345,22 +591,35 @@ const Message Controller::redact(int sessionId, const Message &message) {
   return result;
 }
 
+void Controller::advance(int room) {
+  Room &state = _rooms[room];
+  const Hand &pile = state._deck.discard();
+  state._pileReset = !pile.startsWith(state._pile);
+  state._pileChange = state._pileReset ? pile : pile.from(state._pile.size());
+  state._pile = pile;
+  state._version++;
+}
+
+bool Controller::legalPlays(Player *player, int room, Plays &plays) {
+  return player != nullptr && isTurn(player) &&
+    _rooms[room]._rules->legalPlays(_rooms[room]._deck, player->_hand, plays);
+}
+
 bool Controller::canPlay(int sessionId, string &message) {
-  auto player = find_if(_players.begin(), _players.end(), [&](PlayerPtr &next) {
-    return next->_sessionId == sessionId;
-  });
+  TraceSpan span("canPlay", sessionId);
+  Player *player = findSession(sessionId);
   bool result;
-  if (player != _players.end()) {
-    int room = (*player)->_room;
+  if (player != nullptr) {
+    int room = player->_room;
     Rules *rules = _rooms[room]._rules;
     Deck &deck = _rooms[room]._deck;
 
-    result = rules->canPlay(deck, (*player)->_hand);
+    result = rules->canPlay(deck, player->_hand);
     if (!result && rules->noPlayTakesDiscard()) {
-      deck.takeDiscard((*player)->_hand);
-      (*player)->_hand.sort(rules->getRank());
-      result = rules->canPlay(deck, (*player)->_hand);
-      message.append(" " + (*player)->name() + " picked up the deck.");
+      deck.takeDiscard(player->_hand);
+      player->_hand.sort(rules->getRank());
+      result = rules->canPlay(deck, player->_hand);
+      message.append(" " + player->name() + " picked up the deck.");
     }
   } else {
     result = false;
@@ -368,44 +627,175 @@ bool Controller::canPlay(int sessionId, string &message) {
   return result;
 }
 
-const string Controller::cards(PlayerPtr &player, int room, const string &message) {
-  string json;
-  json.push_back('{');
-  json.append(field("pile", _rooms[room]._deck.getDiscard(), false));
-  json.append(field("message", message, true));
-  json.append(field("turn", _rooms[room]._turn, true));
-  json.append(field("faceDown", _rooms[room]._rules->faceDown(), true));
-  json.append(field("game", _rooms[room]._rules->name(), true));
+void Controller::cards(JsonWriter &json, Player *player, int room, const string &message) {
+  json.raw(render(room, message)._cards);
   if (player != nullptr) {
-    json.append(field("hand", player->_hand.toJson(), true));
-    json.append(field("sessionId", player->_sessionId, true));
+    // splice in the player's hand
+    json.fieldJson("hand", player->_hand.toJson(), true);
+    json.field("sessionId", player->_sessionId, true);
+    Plays plays;
+    if (legalPlays(player, room, plays)) {
+      playsJson(json, plays);
+    }
   }
-  json.push_back('}');
-  return envelope("cards", json);
+  json.raw("}}", 2);
 }
 
-vector<unique_ptr<Player>>::iterator Controller::findSession(int sessionId) {
-  return find_if(_players.begin(), _players.end(), [&](PlayerPtr &next) {
-    return next->_sessionId == sessionId;
-  });
+const string Controller::cards(Player *player, int room, const string &message) {
+  JsonWriter json;
+  cards(json, player, room, message);
+  return json.str();
 }
 
-MessageType Controller::getMessageType(const string &str) const {
-  MessageType result;
-  if (messageTypes.find(str) == messageTypes.end()) {
-    result = kZUnknown;
+const string Controller::cardsBinary(Player *player, int room, const string &message, MessageType type) {
+  BinaryWriter writer;
+  writer.byte(type);
+  Plays legal;
+  bool plays = legalPlays(player, room, legal);
+  writer.byte((player != nullptr ? kBinaryHand : 0) | (plays ? kBinaryPlays : 0));
+  writer.varint(_rooms[room]._turn + 1);
+  writer.byte(_rooms[room]._rules->faceDown());
+  writer.cards(_rooms[room]._deck.discard());
+  if (player != nullptr) {
+    writer.varint(player->_sessionId);
+    writer.mask(player->_hand.toMask());
+  }
+  if (plays) {
+    writer.varint(legal._count);
+    for (int i = 0; i < legal._count; i++) {
+      writer.mask(legal._plays[i]);
+    }
+  }
+  writer.text(message);
+  writer.text(_rooms[room]._rules->name());
+  return writer._buffer;
+}
+
+bool Controller::cards(Message &response, Player *recipient, Player *player, int room, const string &message, MessageType type) {
+  bool result;
+  Snapshot snapshot = player != nullptr ? kSnapshotFull : kSnapshotRoom;
+  if (recipient != nullptr && recipient->_binary) {
+    result = response.build(cardsBinary(player, room, message, type), type, true);
+  } else if (recipient != nullptr && recipient->_deltas && recipient->_version > 0 &&
+             recipient->_version >= _rooms[room]._version - 1) {
+    // the client holds this or the previous version
+    JsonWriter json;
+    delta(json, recipient, room, message);
+    result = response.build(json.frame(), type);
+    snapshot = kSnapshotNone;
+    recipient->_sent = recipient->_hand;
+    recipient->_version = _rooms[room]._version;
+  } else {
+    JsonWriter json;
+    cards(json, player, room, message);
+    result = response.build(json.frame(), type);
+    if (recipient != nullptr && recipient->_deltas) {
+      if (player == recipient) {
+        recipient->_sent = recipient->_hand;
+      }
+      recipient->_version = _rooms[room]._version;
+    }
+  }
+  if (result) {
+    response._frame->_snapshot = snapshot;
+  }
+  return result;
+}
+
+void Controller::delta(JsonWriter &json, Player *player, int room, const string &message) {
+  Hand removed(player->_sent);
+  removed.remove(player->_hand);
+  Hand kept(player->_sent);
+  kept.remove(removed);
+
+  if (player->_version != _rooms[room]._version) {
+    // the room changes are the same for everyone a version behind
+    json.raw(render(room, message)._delta);
   } else {
-    result = messageTypes.at(str);
+    openDelta(json, _rooms[room]._version, player->_version, message, _rooms[room]._turn);
+  }
+  if (kept.size() != player->_hand.size() || !player->_hand.startsWith(kept)) {
+    // new or reordered cards take their place in the hand's order, so it's sent whole
+    json.fieldJson("hand", player->_hand.toJson(), true);
+  } else if (removed.size()) {
+    json.fieldJson("handRemove", removed.toJson(), true);
+  }
+  Plays plays;
+  if (legalPlays(player, room, plays)) {
+    playsJson(json, plays);
+  }
+  json.raw("}}", 2);
+}
+
+const RoomView &Controller::render(int room, const string &message) {
+  TraceSpan span("render", room);
+  Room &state = _rooms[room];
+  RoomView &view = state._view;
+  if (view._version != state._version || view._turn != state._turn || view._message != message) {
+    view._cards.clear();
+    view._cards.push_back('{');
+    view._cards.append(field("id", "cards", false));
+    view._cards.append(",\"data\":{");
+    view._cards.append(fieldJson("pile", state._deck.getDiscard(), false));
+    view._cards.append(field("message", message, true));
+    view._cards.append(field("turn", state._turn, true));
+    view._cards.append(field("faceDown", state._rules->faceDown(), true));
+    view._cards.append(field("game", state._rules->name(), true));
+    view._cards.append(field("version", state._version, true));
+
+    JsonWriter delta;
+    openDelta(delta, state._version, state._version - 1, message, state._turn);
+    delta.fieldJson(state._pileReset ? "pile" : "pileAdd", state._pileChange.toJson(), true);
+    view._delta = delta.str();
+
+    view._message = message;
+    view._version = state._version;
+    view._turn = state._turn;
+  }
+  return view;
+}
+
+int Controller::nextSessionId() {
+  return nextId++;
+}
+
+MessageType Controller::getMessageType(const unsigned char *data) {
+  TraceSpan span("parse");
+  MessageType result;
+  switch (command((const char *)data)) {
+  case command("chat:"): result = kChat; break;
+  case command("deal:"): result = kDeal; break;
+  case command("exch:"): result = kExchange; break;
+  case command("init:"): result = kInit; break;
+  case command("join:"): result = kJoin; break;
+  case command("nicn:"): result = kNicname; break;
+  case command("picu:"): result = kPickup; break;
+  case command("putd:"): result = kPutDown; break;
+  case command("room:"): result = kRoom; break;
+  case command("shuf:"): result = kShuffle; break;
+  case command("skip:"): result = kSkip; break;
+  case command("sync:"): result = kSync; break;
+  default: result = kZUnknown; break;
   }
   return result;
 }
 
+void Controller::leave(int room, int sessionId) {
+  auto &members = _rooms[room]._members;
+  auto member = find(members.begin(), members.end(), sessionId);
+  if (member != members.end()) {
+    members.erase(member);
+    metricRoom(room, -1);
+  }
+}
+
 int Controller::nextTurn(int room) const {
   int size = 0;
   int current = 0;
   int result = -1;
-  for (auto &&player : _players) {
-    if (player->_room == room && player->_state == kDealt) {
+  for (int id : _rooms[room]._members) {
+    Player *player = findSession(id);
+    if (player != nullptr && player->_state == kDealt) {
       if (player->_sessionId == _rooms[room]._turn) {
         current = size;
       } else if (_rooms[room]._turn == -1) {
@@ -418,8 +808,9 @@ int Controller::nextTurn(int room) const {
   if (size) {
     int turn = (current + 1) % size;
     int count = 0;
-    for (auto &&player : _players) {
-      if (player->_room == room && player->_state == kDealt) {
+    for (int id : _rooms[room]._members) {
+      Player *player = findSession(id);
+      if (player != nullptr && player->_state == kDealt) {
         if (turn == count) {
           result = player->_sessionId;
           break;
@@ -435,11 +826,8 @@ int Controller::playing(int room) {
   int result = 0;
   for (int i = 0; i < slots(room); i++) {
     int slot = _rooms[room]._slots[i];
-    if (slot != -1) {
-      auto player = findSession(slot);
-      if (player != _players.end()) {
-        result++;
-      }
+    if (slot != -1 && findSession(slot) != nullptr) {
+      result++;
     }
   }
   return result;
@@ -461,9 +849,9 @@ const string Controller::players(int room) {
       // empty slot
       result.append(::player(-1, false, "empty " + fromInt(i + 1)));
     } else {
-      auto session = findSession(sessionId);
-      if (session != _players.end()) {
-        result.append((*session)->toJson());
+      Player *session = findSession(sessionId);
+      if (session != nullptr) {
+        result.append(session->toJson());
       } else {
         // slot was invalid
         _rooms[room]._slots[i] = -1;
@@ -475,7 +863,7 @@ const string Controller::players(int room) {
   return result;
 }
 
-void Controller::saveState(PlayerPtr &player) {
+void Controller::saveState(Player *player) {
   int room = player->_room;
   _rooms[room]._saveState._deck = _rooms[room]._deck;
   _rooms[room]._saveState._hand = player->_hand;
@@ -483,9 +871,10 @@ void Controller::saveState(PlayerPtr &player) {
 }
 
 void Controller::setNextTurn(int room, string &message) {
+  TraceSpan span("setNextTurn", room);
   int current = _rooms[room]._turn;
   int next = nextTurn(room);
-  for (size_t count = 0; next != current && count < _players.size(); count++) {
+  for (size_t count = 0; next != current && count < _rooms[room]._members.size(); count++) {
     if (canPlay(next, message)) {
       _rooms[room]._turn = next;
       break;
@@ -495,16 +884,16 @@ void Controller::setNextTurn(int room, string &message) {
   }
 }
 
-bool Controller::isTurn(PlayerPtr &player) {
+bool Controller::isTurn(Player *player) {
   int turn = _rooms[player->_room]._turn;
   return turn == -1 || player->_sessionId == turn;
 }
 
-bool Controller::chat(Message &response, PlayerPtr &player, const string &str) {
-  return response.build(message(player->name() + " " + str), kChat);
+bool Controller::chat(Message &response, Player *player, const string &str) {
+  return response.build(messageFrame(player->name() + " " + str), kChat);
 }
 
-bool Controller::deal(Message &response, PlayerPtr &player) {
+bool Controller::deal(Message &response, Player *player) {
   int room = player->_room;
   Rules *rules = _rooms[room]._rules;
 
@@ -516,15 +905,16 @@ bool Controller::deal(Message &response, PlayerPtr &player) {
 
   response.broadcast(player->name() + " received cards");
   string ready = string("Ready to play: <a target=new href='") + rules->url() + "'>" + string(rules->name()) + "</a>";
-  return response.build(cards(player, room, ready), kDeal);
+  return cards(response, player, player, room, ready, kDeal);
 }
 
-bool Controller::gameover(Message &response, PlayerPtr &player) {
+bool Controller::gameover(Message &response, Player *player) {
   string message = player->name() + " won the round, you can't beat skill!<br/><br/>Score:";
   player->_points++;
 
-  for (auto &&next : _players) {
-    if (next->_room == player->_room) {
+  for (int id : _rooms[player->_room]._members) {
+    Player *next = findSession(id);
+    if (next != nullptr) {
       if (next->_state == kDealt) {
         next->_state = kJoined;
       }
@@ -535,82 +925,140 @@ bool Controller::gameover(Message &response, PlayerPtr &player) {
         .append(fromInt(next->_points));
     }
   }
+  advance(player->_room);
   response.broadcast(message);
-  return response.build(cards(player, player->_room, message), kPutDown);
+  return cards(response, player, player, player->_room, message, kPutDown);
 }
 
-bool Controller::exchange(Message &response, PlayerPtr &player, const string &str) {
-  istringstream stream(str);
-  string out, toId, hand;
-  char command = '\0';
-
-  for (int i = 0; i < 3 && getline(stream, out, ':'); i++) {
-    switch (i) {
-    case 0:
-      command = out[0];
-      break;
-    case 1:
-      toId = out;
-      break;
-    case 2:
-      hand = out;
-      break;
+bool Controller::exchange(Message &response, Player *player, const char *data, size_t len) {
+  // command:toId:hand
+  const char *part[3] = {data, data + len, data + len};
+  size_t partLen[3] = {len, 0, 0};
+  for (int i = 0; i < 2; i++) {
+    const char *colon = (const char *)memchr(part[i], ':', partLen[i]);
+    if (colon != nullptr) {
+      part[i + 1] = colon + 1;
+      partLen[i + 1] = part[i] + partLen[i] - part[i + 1];
+      partLen[i] = colon - part[i];
     }
   }
+  Hand hand;
+  toHand(part[2], partLen[2], hand);
+  return exchange(response, player, partLen[0] ? part[0][0] : '\0', toInt(part[1], partLen[1]), hand);
+}
 
-  string result;
-  MessageType messageType = kChat;
-  Hand toGive(toArray(hand));
-  auto fromPlayer = findSession(toInt(toId));
+bool Controller::exchange(Message &response, Player *player, char command, int fromId, const Hand &toGive) {
+  bool result;
+  Player *fromPlayer = findSession(fromId);
 
-  if (fromPlayer == _players.end()) {
-    result = message("other player has left");
+  if (fromPlayer == nullptr) {
+    result = response.build(message("other player has left"), kChat);
   } else if (command == 'Q') {
     string json;
     json.push_back('{');
     json.append(field("fromId", player->_sessionId, false));
     json.append(field("from", player->name(), true));
-    json.append(field("toId", toId, true));
-    json.append(field("hand", hand, true));
-    json.append(field("message", player->name() + " offering " + toGive.toString() + " to " + (*fromPlayer)->name(), true));
+    json.append(field("toId", fromInt(fromId), true));
+    json.append(fieldJson("hand", toGive.toJson(), true));
+    json.append(field("message", player->name() + " offering " + toGive.toString() + " to " + fromPlayer->name(), true));
     json.push_back('}');
-    result = envelope("exchange", json);
-  } else if ((*fromPlayer)->_hand.has(toGive)) {
+    result = response.build(envelope("exchange", json), kChat);
+  } else if (fromPlayer->_hand.has(toGive)) {
     Rules *rules = _rooms[player->_room]._rules;
-    (*fromPlayer)->_hand.remove(toGive);
+    fromPlayer->_hand.remove(toGive);
     player->_hand.addAll(toGive);
     player->_hand.sort(rules->getRank());
-    result = cards(player, player->_room, player->name() + " took " + toGive.toString() + " from " + (*fromPlayer)->name());
-    messageType = kExchange;
+    advance(player->_room);
+    result = cards(response, player, player, player->_room,
+                   player->name() + " took " + toGive.toString() + " from " + fromPlayer->name(), kExchange);
   } else {
-    result = message((*fromPlayer)->name() + " no longer has " + toGive.toString() + " to give");
+    result = response.build(message(fromPlayer->name() + " no longer has " + toGive.toString() + " to give"), kChat);
+  }
+  return result;
+}
+
+bool Controller::handleBinary(Message &response, Player *player, const unsigned char *data, size_t len) {
+  BinaryReader reader(data + 1, len - 1);
+  bool result = true;
+  switch (data[0]) {
+  case kChat:
+    result = chat(response, player, reader.restText());
+    break;
+  case kDeal:
+    result = deal(response, player);
+    break;
+  case kExchange: {
+    char command = reader.byte();
+    int fromId = reader.varint();
+    if (!reader._error) {
+      result = exchange(response, player, command, fromId, reader.rest());
+    }
+    break;
+  }
+  case kInit:
+    result = init(response, player);
+    break;
+  case kJoin: {
+    int slot = reader.varint();
+    if (!reader._error) {
+      result = join(response, player, fromInt(slot));
+    }
+    break;
+  }
+  case kNicname:
+    result = nic(response, player, reader.restText());
+    break;
+  case kPickup:
+    result = pickup(response, player, reader.empty() ? "" : fromInt(reader.varint()));
+    break;
+  case kPutDown:
+    result = putdown(response, player, reader.rest());
+    break;
+  case kRoom:
+    result = room(response, player, reader.empty() ? "" : fromInt(reader.varint()));
+    break;
+  case kShuffle:
+    result = shuffle(response, player, reader.restText());
+    break;
+  case kSkip:
+    result = skip(response, player);
+    break;
+  case kSync:
+    result = sync(response, player);
+    break;
+  default:
+    log("invalid binary message: %d\n", data[0]);
+    break;
   }
-  return response.build(result, messageType);
+  if (reader._error) {
+    log("truncated binary message: %d\n", data[0]);
+  }
+  return result;
 }
 
-bool Controller::init(Message &response, PlayerPtr &player) {
+bool Controller::init(Message &response, Player *player) {
   const string welcome = "<p>" PACKAGE_STRING;
   string json;
   json.push_back('{');
   json.append(field("welcome", welcome, false));
   json.append(field("sessionId", player->_sessionId, true));
-  json.append(field("players", players(player->_room), true));
+  json.append(fieldJson("players", players(player->_room), true));
   json.push_back('}');
 
   return response.build(envelope("init", json), kInit);
 }
 
-const string Controller::joinError(PlayerPtr &player) {
+const string Controller::joinError(Player *player) {
   // refresh players
   string json;
   json.push_back('{');
   json.append(field("message", player->name() + " poked nobody", false));
-  json.append(field("players", players(player->_room), true));
+  json.append(fieldJson("players", players(player->_room), true));
   json.push_back('}');
   return envelope("players", json);
 }
 
-bool Controller::join(Message &response, PlayerPtr &player, const string &str) {
+bool Controller::join(Message &response, Player *player, const string &str) {
   string result;
   int slot = toInt(str);
   int room = player->_room;
@@ -624,12 +1072,13 @@ bool Controller::join(Message &response, PlayerPtr &player, const string &str) {
     string json;
     json.push_back('{');
     json.append(field("message", player->name() + " has joined the game in room " + fromInt(room + 1), false));
-    json.append(field("players", players(room), true));
+    json.append(fieldJson("players", players(room), true));
 
     int dealt = 0;
     int cards = 0;
-    for (auto &&next : _players) {
-      if (next->_room == player->_room && next->_state == kDealt) {
+    for (int id : _rooms[room]._members) {
+      Player *next = findSession(id);
+      if (next != nullptr && next->_state == kDealt) {
         dealt++;
         if (next->_hand.size() == rules->handSize(playing(room))) {
           cards++;
@@ -645,31 +1094,31 @@ bool Controller::join(Message &response, PlayerPtr &player, const string &str) {
     json.push_back('}');
     result = envelope("players", json);
   } else if (slot >= 0 && slot < slots(room) && _rooms[room]._slots[slot] != -1) {
-    auto other = find_if(_players.begin(), _players.end(), [&](PlayerPtr &next) {
-      return next->_room == room && next->_sessionId == _rooms[room]._slots[slot];
-    });
-    if (other != _players.end()) {
+    Player *other = findSession(_rooms[room]._slots[slot]);
+    if (other != nullptr && other->_room == room) {
       if (rules->canRevoke() && _rooms[room]._saveState._sessionId != -1 &&
-          (*other)->_sessionId == player->_sessionId && (*other)->_sessionId == _rooms[room]._saveState._sessionId) {
+          other->_sessionId == player->_sessionId && other->_sessionId == _rooms[room]._saveState._sessionId) {
         // revoke the last players turn
         _rooms[room]._saveState._sessionId = -1;
         _rooms[room]._deck = _rooms[room]._saveState._deck;
-        (*other)->_hand = _rooms[room]._saveState._hand;
+        other->_hand = _rooms[room]._saveState._hand;
         _rooms[room]._turn = nextTurn(room);
-        result = cards((*other), room, (*other)->name() + " play revoked by " + player->_nicname);
+        advance(room);
+        result = cards(other, room, other->name() + " play revoked by " + player->_nicname);
       } else {
-        if ((*other)->_sessionId == player->_sessionId) {
+        if (other->_sessionId == player->_sessionId) {
           // poked self
           if (player->_state == kDealt && player->_sessionId == _rooms[room]._turn) {
             _rooms[room]._turn = nextTurn(room);
+            advance(room);
             result = cards(nullptr, room, player->name() + " skipped their turn");
           } else {
             result = message(player->name() + " has " + fromInt(player->_hand.size()) + " cards");
           }
         } else {
           // poke other player
-          result = message(player->name() + " poked " + (*other)->_nicname + " [" +
-                           fromInt((*other)->_hand.size()) + " cards]");
+          result = message(player->name() + " poked " + other->_nicname + " [" +
+                           fromInt(other->_hand.size()) + " cards]");
         }
       }
     } else {
@@ -681,23 +1130,16 @@ bool Controller::join(Message &response, PlayerPtr &player, const string &str) {
   return response.build(result, kJoin);
 }
 
-bool Controller::nic(Message &response, PlayerPtr &player, const string &str) {
+bool Controller::nic(Message &response, Player *player, const string &str) {
   string result;
   if (player->_state != kLurk) {
-    auto other = find_if(_players.begin(), _players.end(), [&](PlayerPtr &next) {
-      return next->_sessionId != player->_sessionId &&
-        equal(next->_nicname.begin(), next->_nicname.end(), str.begin(), [](const char &c1, const char &c2) {
-            return (c1 == c2 || toupper(c1) == toupper(c2));
-          });
-    });
-    if (other == _players.end()) {
-      string old = player->name();
-      player->_nicname = replace(str, "\"", "");
-
+    string nicname = replace(str, "\"", "");
+    string old = player->name();
+    if (_players.rename(player, nicname)) {
       string json;
       json.push_back('{');
       json.append(field("message", old + " changed nic to: " + player->_nicname, false));
-      json.append(field("players", players(player->_room), true));
+      json.append(fieldJson("players", players(player->_room), true));
       json.push_back('}');
 
       result = envelope("players", json);
@@ -710,7 +1152,7 @@ bool Controller::nic(Message &response, PlayerPtr &player, const string &str) {
   return response.build(result, kNicname);
 }
 
-bool Controller::pickup(Message &response, PlayerPtr &player, string count) {
+bool Controller::pickup(Message &response, Player *player, string count) {
   bool result;
   if (isTurn(player)) {
     int room = player->_room;
@@ -729,8 +1171,9 @@ bool Controller::pickup(Message &response, PlayerPtr &player, string count) {
       player->_hand.sort(rules->getRank());
       saveState(player);
       setNextTurn(room, message);
+      advance(room);
       response.broadcast(player->name() + " took " + fromInt(n) + " card from the deck");
-      result = response.build(cards(player, player->_room, message), kPickup);
+      result = cards(response, player, player, player->_room, message, kPickup);
     } else {
       result = chat(response, player, "nothing to pickup!");
     }
@@ -740,14 +1183,26 @@ bool Controller::pickup(Message &response, PlayerPtr &player, string count) {
   return result;
 }
 
-bool Controller::putdown(Message &response, PlayerPtr &player, const Hand &hand) {
+// the rules' verdict on the play, traced
+static bool isValidPlay(Rules *rules, const Deck &deck, const Hand &hand) {
+  TraceSpan span("isValidPlay");
+  return rules->isValidPlay(deck, hand);
+}
+
+bool Controller::putdown(Message &response, Player *player, const char *data, size_t len) {
+  Hand hand;
+  toHand(data, len, hand);
+  return putdown(response, player, hand);
+}
+
+bool Controller::putdown(Message &response, Player *player, const Hand &hand) {
   bool result;
   if (isTurn(player)) {
     int room = player->_room;
     Rules *rules = _rooms[room]._rules;
     Deck &deck = _rooms[room]._deck;
     int discardSize = deck.discardSize();
-    if (rules->isValidPlay(deck, hand)) {
+    if (isValidPlay(rules, deck, hand)) {
       saveState(player);
       player->_hand.remove(hand);
       deck.putdown(hand);
@@ -764,8 +1219,9 @@ bool Controller::putdown(Message &response, PlayerPtr &player, const Hand &hand)
         if (rules->setNextTurn(hand)) {
           setNextTurn(room, message);
         }
+        advance(room);
         response.broadcast(message);
-        result = response.build(cards(player, player->_room, response.broadcast()), kPutDown);
+        result = cards(response, player, player, player->_room, response.broadcast(), kPutDown);
       }
     } else {
       result = chat(response, player, "invalid play!");
@@ -777,7 +1233,7 @@ bool Controller::putdown(Message &response, PlayerPtr &player, const Hand &hand)
   return result;
 }
 
-bool Controller::room(Message &response, PlayerPtr &player, const string &str) {
+bool Controller::room(Message &response, Player *player, const string &str) {
   string result;
   int newRoom = toInt(str) - 1;
   int room = player->_room;
@@ -791,16 +1247,20 @@ bool Controller::room(Message &response, PlayerPtr &player, const string &str) {
     if (player->_slot > -1 && player->_slot < slots(room)) {
       _rooms[room]._slots[player->_slot] = -1;
     }
+    leave(room, player->_sessionId);
+    _rooms[newRoom]._members.push_back(player->_sessionId);
+    metricRoom(newRoom, 1);
     player->_hand.clear();
     player->_room = newRoom;
     player->_slot = -1;
     player->_state = kLurk;
     player->_points = 0;
+    player->_version = 0;
     string json;
     string message = player->name() + " entered room " + fromInt(newRoom + 1) +  ", " + _rooms[newRoom]._rules->name();
     json.push_back('{');
     json.append(field("message", message), false);
-    json.append(field("players", players(newRoom), true));
+    json.append(fieldJson("players", players(newRoom), true));
     json.append(field("turn", _rooms[newRoom]._turn, true));
     json.append(field("clearHandId", player->_sessionId, true));
     json.append(field("game", _rooms[newRoom]._rules->name(), true));
@@ -812,15 +1272,16 @@ bool Controller::room(Message &response, PlayerPtr &player, const string &str) {
   return response.build(result, kRoom);
 }
 
-bool Controller::shuffle(Message &response, PlayerPtr &player, const string &str) {
+bool Controller::shuffle(Message &response, Player *player, const string &str) {
   string result;
   if (str.find("help") != string::npos) {
     result = message("deal");
   } else if (player->_state != kLurk) {
     int room = player->_room;
     _rooms[room]._deck.shuffle();
-    for (auto &&next : _players) {
-      if (next->_room == player->_room) {
+    for (int id : _rooms[room]._members) {
+      Player *next = findSession(id);
+      if (next != nullptr) {
         if (next->_state == kDealt) {
           next->_state = kJoined;
         }
@@ -828,38 +1289,58 @@ bool Controller::shuffle(Message &response, PlayerPtr &player, const string &str
         _rooms[room]._turn = next->_sessionId;
       }
     }
-    result = envelope("shuffle", "ready");
+    advance(room);
+    result = envelope("shuffle", "\"ready\"");
   } else {
     result = message("select your avatar!");
   }
   return response.build(result, kShuffle);
 }
 
-bool Controller::skip(Message &response, PlayerPtr &player) {
-  string result;
+bool Controller::skip(Message &response, Player *player) {
+  bool result;
   int room = player->_room;
   if (player->_state == kDealt && player->_sessionId == _rooms[room]._turn) {
     _rooms[room]._turn = nextTurn(room);
+    advance(room);
     string message = player->name() + " skipped their turn";
     response.broadcast(message);
-    result = cards(nullptr, room, message);
+    result = cards(response, player, nullptr, room, message, kSkip);
   } else {
-    result = message(player->name() + " says hello");
+    result = response.build(message(player->name() + " says hello"), kSkip);
   }
-  return response.build(result, kSkip);
+  return result;
+}
+
+bool Controller::sync(Message &response, Player *player) {
+  // binary frames are always in full
+  player->_deltas = !player->_binary;
+  player->_version = 0;
+  return cards(response, player, player, player->_room, "", kSync);
 }
 
 #if defined(_TEST)
 #include <libwebsockets.h>
 #include <stdio.h>
+#include <thread>
+#include "histogram.h"
+#include "json.h"
+#include "pool.h"
+#include "profiler.h"
 void print(Message &message) {
-  if (message._len) {
-    for (int i = 0; i < message._len; i++) {
-      printf("%c", message._data[i + LWS_PRE]);
+  if (message._frame != nullptr) {
+    for (int i = 0; i < message._frame->_len; i++) {
+      printf("%c", message._frame->_data[i + LWS_PRE]);
     }
     printf("\n");
   }
 }
+// whether the message text contains the given text
+static bool contains(Message &message, const char *text) {
+  return message._frame != nullptr &&
+    string((const char *)message._frame->_data + LWS_PRE, message._frame->_len).find(text) != string::npos;
+}
+
 int main() {
   Controller controller;
   Message message;
@@ -895,11 +1376,348 @@ int main() {
   controller.handle(picu, message, session1); print(message);
   controller.handle(putd, message, session2); print(message);
 
+  if (controller.members(session1).size() != 3) {
+    fprintf(stderr, "test failed: room members\n");
+  }
+  string room2 = "room:2";
+  controller.handle(room2, message, session3); print(message);
+  if (controller.members(session1).size() != 2 || controller.members(session3).size() != 1) {
+    fprintf(stderr, "test failed: room change members\n");
+  }
+
+  // hand a player over to another controller
+  Controller shard;
+  Player handoff(0);
+  int session4 = controller.createSession();
+  if (!controller.detach(session4, handoff) || controller.members(session4).size() != 0) {
+    fprintf(stderr, "test failed: detach\n");
+  }
+  shard.attach(handoff);
+  string room3 = "room:3";
+  shard.handle(room3, message, session4); print(message);
+  if (shard.members(session4).size() != 1 || Controller::requestedRoom((const unsigned char *)"room:3", 6) != 2) {
+    fprintf(stderr, "test failed: attach\n");
+  }
+
+  // nicnames are unique across controllers and stay held while a player moves between them
+  string nicBar = "nicn:Bar";
+  string nicbar = "nicn:bar";
+  string join5 = "join:3";
+  string join4 = "join:0";
+  int session5 = controller.createSession();
+  controller.handle(join5, message, session5);
+  controller.handle(nicBar, message, session5);
+  if (!contains(message, "changed nic")) {
+    fprintf(stderr, "test failed: nicname set\n");
+  }
+  shard.handle(join4, message, session4);
+  shard.handle(nicbar, message, session4);
+  if (!contains(message, "already exists")) {
+    fprintf(stderr, "test failed: nicname unique across controllers\n");
+  }
+  Player moved(0);
+  controller.detach(session5, moved);
+  shard.handle(nicbar, message, session4);
+  if (!contains(message, "already exists")) {
+    fprintf(stderr, "test failed: nicname held during hand over\n");
+  }
+  shard.attach(moved);
+  shard.handle(nicbar, message, session4);
+  if (!contains(message, "already exists")) {
+    fprintf(stderr, "test failed: nicname kept after hand over\n");
+  }
+  shard.destroySession(session5);
+  shard.handle(nicbar, message, session4);
+  if (!contains(message, "changed nic")) {
+    fprintf(stderr, "test failed: nicname released\n");
+  }
+  string nicOther = "nicn:#" + fromInt(session5);
+  shard.handle(nicOther, message, session4);
+  if (!contains(message, "already exists")) {
+    fprintf(stderr, "test failed: session names are reserved\n");
+  }
+
   // cleanup
   controller.destroySession(session1);
   controller.destroySession(session1);
   controller.destroySession(session1);
 
+  Players directory;
+  Player *foo = directory.add(100);
+  directory.rename(foo, "Foo");
+  if (directory.find(100) != foo || directory.findNic("fOO") != foo) {
+    fprintf(stderr, "test failed: player directory lookup\n");
+  }
+  directory.remove(100);
+  if (directory.find(100) != nullptr || directory.findNic("foo") != nullptr) {
+    fprintf(stderr, "test failed: player directory remove\n");
+  }
+  if (directory.add(101) != foo || directory.size() != 1) {
+    fprintf(stderr, "test failed: player directory slot reuse\n");
+  }
+
+  // a copied hand builds its own JSON once it is asked for
+  Hand original;
+  original.add(static_cast<Card>(0));
+  original.toJson();
+  Hand copied(original);
+  copied.add(static_cast<Card>(1));
+  if (copied.toJson() != "[\"2C\",\"2S\"]" || original.toJson() != "[\"2C\"]") {
+    fprintf(stderr, "test failed: hand copy JSON\n");
+  }
+
+  // a shared compressed frame is built once, header first
+  string text(1000, 'x');
+  Frame *plain = Frame::create((const unsigned char *)text.c_str(), text.length());
+  Frame *deflated = plain->deflated();
+  if (deflated == nullptr || deflated != plain->deflated() ||
+      deflated->_data[LWS_PRE] != 0xc1 || deflated->_len >= plain->_len) {
+    fprintf(stderr, "test failed: deflated frame\n");
+  }
+  // and every frame carries its own header, ready to send raw
+  const unsigned char *wire = plain->wire();
+  if (plain->wireLen() != 1004 || wire[0] != 0x81 || wire[1] != 126 || wire[2] != 0x03 ||
+      wire[3] != 0xe8 || wire[4] != 'x') {
+    fprintf(stderr, "test failed: frame header\n");
+  }
+  plain->release();
+
+  // binary protocol sessions send and receive compact frames
+  Controller binary;
+  binary.createSession(200, true);
+  const unsigned char bjoin[] = {kJoin, 0};
+  const unsigned char bshuf[] = {kShuffle};
+  const unsigned char bdeal[] = {kDeal};
+  const unsigned char broom[] = {kRoom, 3};
+  binary.handle(bjoin, sizeof(bjoin), message, 200);
+  binary.handle(bshuf, sizeof(bshuf), message, 200);
+  binary.handle(bdeal, sizeof(bdeal), message, 200);
+  if (!message._frame->_binary || message._frame->_data[LWS_PRE] != kDeal ||
+      message._frame->_data[LWS_PRE + 1] != (kBinaryHand | kBinaryPlays)) {
+    fprintf(stderr, "test failed: binary cards frame\n");
+  }
+  if (Controller::requestedRoom(broom, sizeof(broom), true) != 2) {
+    fprintf(stderr, "test failed: binary room request\n");
+  }
+  // after syncing, changes arrive as deltas
+  Controller deltas;
+  deltas.createSession(300);
+  string sync = "sync:";
+  deltas.handle(sync, message, 300);
+  deltas.handle(join1, message, 300);
+  deltas.handle(shuf, message, 300);
+  deltas.handle(deal, message, 300);
+  string dealt((const char *)message._frame->_data + LWS_PRE, message._frame->_len);
+  deltas.handle("putd:[\"4C\"]", message, 300);
+  string played((const char *)message._frame->_data + LWS_PRE, message._frame->_len);
+  if (dealt.find("{\"id\":\"delta\"") != 0 || dealt.find("\"pileAdd\":[]") == string::npos ||
+      dealt.find("\"playable\":4503599627370495,\"plays\":[15,14,13,") == string::npos ||
+      played.find("\"pileAdd\":[\"4C\"]") == string::npos ||
+      played.find("\"handRemove\":[\"4C\"]") == string::npos) {
+    fprintf(stderr, "test failed: delta frames\n");
+  }
+  // rules free deals seven, leaving a pack to pick up from
+  deltas.createSession(301);
+  deltas.handle(sync, message, 301);
+  deltas.handle("room:10", message, 301);
+  deltas.handle(join1, message, 301);
+  deltas.handle(shuf, message, 301);
+  deltas.handle(deal, message, 301);
+  deltas.handle("picu:1", message, 301);
+  string picked((const char *)message._frame->_data + LWS_PRE, message._frame->_len);
+  size_t hand = picked.find("\"hand\":[");
+  if (dealt.find("\"hand\":[\"") == string::npos || picked.find("{\"id\":\"delta\"") != 0 ||
+      hand == string::npos || count(picked.begin() + hand, picked.begin() + picked.find(']', hand), ',') != 7 ||
+      picked.find("handRemove") != string::npos) {
+    fprintf(stderr, "test failed: delta sends the hand whole when cards arrive %s\n", picked.c_str());
+  }
+
+  // the cached hand JSON follows changes to the hand
+  Hand cached;
+  cached.add(k2c);
+  string before = cached.toJson();
+  cached.add(k3c);
+  string after = cached.toJson();
+  cached.clear();
+  if (before != "[\"2C\"]" || after != "[\"2C\",\"3C\"]" || cached.toJson() != "[]") {
+    fprintf(stderr, "test failed: hand json cache\n");
+  }
+
+  // a slow session keeps only the newest game state
+  MessageQueue queue;
+  queue.create(8, 2);
+  Frame *chat1 = Frame::create((const unsigned char *)"a", 1);
+  Frame *room1 = Frame::create((const unsigned char *)"b", 1);
+  Frame *full1 = Frame::create((const unsigned char *)"c", 1);
+  Frame *full2 = Frame::create((const unsigned char *)"d", 1);
+  room1->_snapshot = kSnapshotRoom;
+  full1->_snapshot = kSnapshotFull;
+  full2->_snapshot = kSnapshotFull;
+  queue.push(chat1);
+  queue.push(room1);
+  queue.push(full1);
+  queue.push(full2);
+  if (queue._size != 2 || queue._superseded != 2 || queue.peek() != chat1) {
+    fprintf(stderr, "test failed: superseded state frames\n");
+  }
+  chat1->release();
+  room1->release();
+  full1->release();
+  full2->release();
+  queue.destroy();
+
+  // pooled buffers are reused within their size class
+  BufferPool pool;
+  size_t capacity;
+  unsigned char *buffer = pool.acquire(300, capacity);
+  pool.release(buffer, capacity);
+  size_t reusedCapacity;
+  if (capacity != 512 || pool.acquire(400, reusedCapacity) != buffer ||
+      pool.acquire(BufferPool::maxSize + 1, reusedCapacity) != nullptr) {
+    fprintf(stderr, "test failed: buffer pool\n");
+  }
+  pool.release(buffer, capacity);
+
+  // counters from every thread are added together
+  metric(kBytesIn, 3);
+  thread counting([] { metric(kBytesIn, 4); });
+  counting.join();
+  string metrics = metricsText();
+  if (metrics.find("kibitzer_received_bytes_total 7\n") == string::npos ||
+      metrics.find("kibitzer_messages_received_total{type=\"init\"} 0\n") != string::npos) {
+    fprintf(stderr, "test failed: metrics\n");
+  }
+
+  // percentiles stay within a bucket's width of the exact value
+  Histogram *histogram = new Histogram();
+  for (uint64_t i = 1; i <= 100000; i++) {
+    histogram->record(i);
+  }
+  HistogramSnapshot snapshot;
+  snapshot.add(*histogram);
+  uint64_t p50 = snapshot.quantile(0.5);
+  uint64_t p999 = snapshot.quantile(0.999);
+  if (p50 < 50000 || p50 > 50000 + 50000 / 16 || p999 < 99900 || p999 > 100000 ||
+      snapshot._count != 100000 || snapshot._max != 100000 ||
+      latencyReport().find("handle init") == string::npos) {
+    fprintf(stderr, "test failed: histogram\n");
+  }
+  delete histogram;
+
+  // spans since the last flush, no more than the ring holds
+  traceStart(8);
+  traceThread("test");
+  int traced = controller.createSession();
+  for (int i = 0; i < 4; i++) {
+    controller.handle(chat, message, traced);
+  }
+  string trace = traceJson();
+  size_t spans = 0;
+  for (size_t at = trace.find("\"ph\":\"X\""); at != string::npos; at = trace.find("\"ph\":\"X\"", at + 1)) {
+    spans++;
+  }
+  if (spans != 8 || trace.find("\"name\":\"handle\"") == string::npos ||
+      trace.find("\"name\":\"test 1\"") == string::npos ||
+      traceJson().find("\"ph\":\"X\"") != string::npos) {
+    fprintf(stderr, "test failed: trace\n");
+  }
+
+  // text is escaped to the JSON spec, whatever the plain runs around it
+  string escaped;
+  string unescaped = "0123456789abcdef\"quoted\" \\ line\nend\x01" + string(20, 'x') + "\t";
+  jsonEscape(escaped, unescaped.data(), unescaped.length());
+  if (escaped != "0123456789abcdef\\\"quoted\\\" \\\\ line\\nend\\u0001" + string(20, 'x') + "\\t") {
+    fprintf(stderr, "test failed: escape\n");
+  }
+
+  // the writer's buffer becomes the frame, and chat can't break out of it
+  JsonWriter json(4);
+  json.field("n", INT_MIN, false);
+  json.field("s", "\"}", true);
+  Frame *written = json.frame();
+  Frame *empty = json.frame();
+  controller.handle("chat:\"},{\"id\":\"x", message, traced);
+  string chatted((const char *)message._frame->_data + LWS_PRE, message._frame->_len);
+  if (written == nullptr || string((const char *)written->_data + LWS_PRE, written->_len) !=
+      "\"n\":-2147483648,\"s\":\"\\\"}\"" || empty == nullptr || empty->_len != 0 ||
+      chatted.find("\"data\":\"") == string::npos ||
+      chatted.substr(chatted.length() - 17) != "\\\"},{\\\"id\\\":\\\"x\"}") {
+    fprintf(stderr, "test failed: json writer %s\n", chatted.c_str());
+  }
+  if (written != nullptr) {
+    written->release();
+  }
+  if (empty != nullptr) {
+    empty->release();
+  }
+  JsonWriter zero(0);
+  zero.raw("[1]", 3);
+  Frame *grown = zero.frame();
+  if (grown == nullptr || grown->_len != 3 || memcmp(grown->_data + LWS_PRE, "[1]", 3) != 0) {
+    fprintf(stderr, "test failed: json writer without capacity\n");
+  }
+  if (grown != nullptr) {
+    grown->release();
+  }
+
+  // counters add up across threads, payload alongside the bytes compression left
+  metric(kBytesPayload, 1000);
+  thread sending([] { metric(kBytesPayload, 24); });
+  sending.join();
+  if (metricTotal(kBytesPayload) != 1024 ||
+      metricsText().find("kibitzer_sent_payload_bytes_total 1024\n") == string::npos) {
+    fprintf(stderr, "test failed: payload bytes\n");
+  }
+  // unknown sessions and bad input aren't allocation failures
+  controller.handle("xxxx:", message, 999999);
+  controller.handle("xx", message, session2);
+  if (metricTotal(kAllocFailures) != 0) {
+    fprintf(stderr, "test failed: alloc failures\n");
+  }
+
+  // work outlasting the threshold is reported once
+  watchThread("test");
+  watchStart(20000000);
+  {
+    WatchBusy busy;
+    watchWork(kDeal, 2, traced);
+    this_thread::sleep_for(chrono::milliseconds(100));
+  }
+  watchStop();
+  if (metricsText().find("kibitzer_stalls_total 1\n") == string::npos) {
+    fprintf(stderr, "test failed: watchdog\n");
+  }
+
+  // cpu used while profiling is sampled, one profile at a time
+  if (!profileStart(1000) || profileStart(1000)) {
+    fprintf(stderr, "test failed: profile start\n");
+  }
+  volatile uint64_t spins = 0;
+  for (uint64_t start = metricNow(); metricNow() - start < 200000000;) {
+    spins = spins + 1;
+  }
+  string profile = profileStop();
+  if (profile.empty() || profile.back() != '\n' || profile.find(' ') == string::npos ||
+      !profileStop().empty()) {
+    fprintf(stderr, "test failed: profile\n");
+  }
+
+#if defined(ALLOC_STATS)
+  // handling a message allocates within its scope
+  controller.handle(chat, message, session1);
+  if (allocReport().find("alloc handle chat") == string::npos ||
+      allocText().find("kibitzer_allocations_total{phase=\"handle\",type=\"chat\"}") == string::npos) {
+    fprintf(stderr, "test failed: alloc stats\n");
+  }
+#endif
+
+  BinaryWriter writer;
+  writer.varint(300);
+  BinaryReader reader((const unsigned char *)writer._buffer.c_str(), writer._buffer.length());
+  if (reader.varint() != 300 || !reader.empty() || reader._error) {
+    fprintf(stderr, "test failed: varint\n");
+  }
+
   Deck deck;
   Hand aces;
   aces.add(kac);
@@ -937,6 +1755,78 @@ int main() {
     fprintf(stderr, "test failed: can't play two on two\n");
   }
 
+  // cards are held once, and removing keeps the order of the rest
+  Hand held;
+  held.add(k9c);
+  held.add(kkh);
+  held.add(k9d);
+  held.add(kkh);
+  held.remove(ten);
+  held.remove(two);
+  Hand nine;
+  nine.add(k9d);
+  held.remove(nine);
+  if (held.size() != 2 || held.toMask() != (cardBit(k9c) | cardBit(kkh)) ||
+      held.toString() != "9C KH" || !held.has(held.from(1)) || held.has(nine)) {
+    fprintf(stderr, "test failed: card set\n");
+  }
+
+  // a pair must be beaten by a higher pair
+  Hand pair;
+  pair.add(k9c);
+  pair.add(k9s);
+  Deck pairs;
+  pairs.putdown(pair);
+  held.add(kks);
+  if (!rules->canPlay(pairs, held) || rules->canPlay(pairs, ace) ||
+      !pair.isEqual(k9h) || pair.isEqual(kkh) || !pair.hasEqual(k9d) || pair.hasEqual(kXc)) {
+    fprintf(stderr, "test failed: pairs\n");
+  }
+
+  // the generated plays are exactly the valid ones
+  Hand mixed;
+  for (Card card : {k2h, k3c, k9c, k9d, k9s, kjh, kqd, kqh, kac, kad}) {
+    mixed.add(card);
+  }
+  Hand queen;
+  queen.add(kqs);
+  Hand kings;
+  kings.add(kkc);
+  kings.add(kks);
+  Deck piles[4];
+  piles[1].putdown(pair);
+  piles[2].putdown(queen);
+  piles[3].putdown(two);
+  for (const Deck &pile : piles) {
+    Plays plays;
+    rules->legalPlays(pile, mixed, plays);
+    bool exact = (plays._count > 0) == rules->canPlay(pile, mixed);
+    CardSet all = mixed.toMask();
+    for (CardSet sub = all; sub != 0; sub = (sub - 1) & all) {
+      exact = exact && plays.has(sub) == rules->isValidPlay(pile, mixed.only(sub));
+    }
+    if (!exact) {
+      fprintf(stderr, "test failed: legal plays\n");
+    }
+  }
+  // plays decode straight into a hand, skipping unknown and repeated codes
+  const char play[] = "[\"QH\", \"XC\",\"ZZ\",\"QH\",\"QHX\"]";
+  Hand parsed;
+  Hand unlisted;
+  if (!toHand(play, sizeof(play) - 1, parsed) || parsed.toString() != "QH XC" ||
+      toHand("\"QH\"", 4, unlisted) || unlisted.size() != 0 ||
+      Controller::requestedRoom((const unsigned char *)"room:3", 6) != 2 ||
+      Controller::requestedRoom((const unsigned char *)"roam:3", 6) != -1) {
+    fprintf(stderr, "test failed: parse\n");
+  }
+
+  Plays none;
+  Deck higher;
+  higher.putdown(kings);
+  if (rules->legalPlays(higher, ace, none) && none._count != 0) {
+    fprintf(stderr, "test failed: no legal plays\n");
+  }
+
   return 0;
 }
 #endif
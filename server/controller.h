@@ -8,10 +8,13 @@
 
 #include <vector>
 #include <memory>
+#include <unordered_map>
 #include "cards.h"
 #include "message.h"
 #include "rules.h"
 
+struct JsonWriter;
+
 using namespace std;
 
 static const int numRooms = 10;
@@ -36,9 +39,48 @@ struct Player {
   int _points;
   int _room;
   PlayerState _state;
+
+  // the session uses the compact binary protocol
+  bool _binary;
+
+  // the client applies delta frames
+  bool _deltas;
+
+  // the room version and hand the client was last sent
+  int _version;
+  Hand _sent;
 };
 
-typedef const unique_ptr<Player> PlayerPtr;
+// players indexed by session id, nicnames are unique across every controller
+struct Players {
+  // adds the player, taking a copy
+  Player *add(const Player &player);
+
+  // returns the player for the session or nullptr
+  Player *find(int sessionId) const;
+
+  // returns the player using the nicname, ignoring case, or nullptr
+  Player *findNic(const string &nicname) const;
+
+  // removes the player for the session, releasing the nicname unless it's kept for a hand over
+  void remove(int sessionId, bool keepNic = false);
+
+  // changes the player's nicname, false when another player holds it
+  bool rename(Player *player, const string &nicname);
+
+  // the number of players
+  int size() const { return (int)_index.size(); }
+
+private:
+  // player slots, never moved so that Player pointers stay valid
+  vector<unique_ptr<Player>> _pool;
+
+  // slots released by departed players
+  vector<int> _free;
+
+  // session id to pool slot
+  unordered_map<int, int> _index;
+};
 
 struct SaveState {
   SaveState() : _sessionId(-1) {}
@@ -47,6 +89,22 @@ struct SaveState {
   int _sessionId;
 };
 
+// the room state rendered once per event and shared by every recipient
+struct RoomView {
+  RoomView() : _version(-1), _turn(-1) {}
+
+  // the cards envelope, open after the fields common to everyone
+  string _cards;
+
+  // the delta envelope from the previous version, open after the fields common to everyone
+  string _delta;
+
+  // the state and message the view was rendered for
+  string _message;
+  int _version;
+  int _turn;
+};
+
 struct Room {
   Room();
   virtual ~Room() {}
@@ -60,36 +118,88 @@ struct Room {
   // the free slots for active players
   vector<int> _slots;
 
+  // session ids of everyone in the room, including lurkers
+  vector<int> _members;
+
   // the rules played in this room
   Rules *_rules;
 
   // session id of the current player turn
   int _turn;
+
+  // advanced with each change of the game sent to the room
+  int _version;
+
+  // the pile as of the version
+  Hand _pile;
+
+  // the cards the version added to the pile, or the whole pile when reset
+  Hand _pileChange;
+  bool _pileReset;
+
+  // the latest event as sent to everyone
+  RoomView _view;
 };
 
 struct Controller {
   Controller();
   virtual ~Controller() {}
 
+  // adds a player handed over from another controller, keeping its room
+  void attach(const Player &player);
+
   int createSession();
+  void createSession(int sessionId, bool binary = false);
   const Message destroySession(int sessionId);
+
+  // removes the player ready to be handed over to another controller
+  bool detach(int sessionId, Player &player);
+
   bool handle(const unsigned char *data, size_t len, Message &response, int sessionId);
   bool handle(const string data, Message &response, int sessionId);
-  bool isSameRoom(int session1, int session2);
+  const vector<int> &members(int sessionId);
+
+  // returns the room requested by a room change message, otherwise -1
+  static int requestedRoom(const unsigned char *data, size_t len, bool binary = false);
+
+  // allocates a new session id, callable from any thread
+  static int nextSessionId();
   const Message redact(int sessionId, const Message &message);
 
 private:
+  // record a change of the game, advancing the room version
+  void advance(int room);
+
   // whether the next turn player can play
   bool canPlay(int sessionId, string &message);
 
   // the game after picking up or putting down
-  const string cards(PlayerPtr &player, int room, const string &message);
+  void cards(JsonWriter &json, Player *player, int room, const string &message);
+  const string cards(Player *player, int room, const string &message);
+
+  // the game as a compact binary frame
+  const string cardsBinary(Player *player, int room, const string &message, MessageType type);
+
+  // build the game for the recipient in its protocol, the hand is included when player is given
+  bool cards(Message &response, Player *recipient, Player *player, int room, const string &message, MessageType type);
+
+  // the changes since the version the player was last sent
+  void delta(JsonWriter &json, Player *player, int room, const string &message);
+
+  // the player's legal plays when it's their turn and the game limits what may be played
+  bool legalPlays(Player *player, int room, Plays &plays);
+
+  // returns the room view for the message, rendering it when the room has changed
+  const RoomView &render(int room, const string &message);
 
   // find the users session
-  vector<unique_ptr<Player>>::iterator findSession(int sessionId);
+  Player *findSession(int sessionId) const { return _players.find(sessionId); }
+
+  // returns the MessageType for the five byte command prefix
+  static MessageType getMessageType(const unsigned char *data);
 
-  // returns the Command enum for the given string
-  MessageType getMessageType(const string &str) const;
+  // remove the session from the room members
+  void leave(int room, int sessionId);
 
   // returns the sessionId of the next players turn
   int nextTurn(int room) const;
@@ -101,7 +211,7 @@ private:
   const string players(int room);
 
   // save the current play state
-  void saveState(PlayerPtr &player);
+  void saveState(Player *player);
 
   // setup the next player
   void setNextTurn(int room, string &message);
@@ -110,49 +220,57 @@ private:
   int slots(int room) const { return (int)_rooms[room]._slots.size(); }
 
   // whether it is the players turn
-  bool isTurn(PlayerPtr &player);
+  bool isTurn(Player *player);
 
   // chat message to all players
-  bool chat(Message &response, PlayerPtr &player, const string &str);
+  bool chat(Message &response, Player *player, const string &str);
 
   // deal out the player's hand
-  bool deal(Message &response, PlayerPtr &player);
+  bool deal(Message &response, Player *player);
 
   // the player won the round
-  bool gameover(Message &response, PlayerPtr &player);
+  bool gameover(Message &response, Player *player);
 
   // player giving cards to another player
-  bool exchange(Message &response, PlayerPtr &player, const string &str);
+  bool exchange(Message &response, Player *player, const char *data, size_t len);
+  bool exchange(Message &response, Player *player, char command, int fromId, const Hand &toGive);
+
+  // handle a message from a binary protocol session
+  bool handleBinary(Message &response, Player *player, const unsigned char *data, size_t len);
 
   // web client init
-  bool init(Message &response, PlayerPtr &player);
+  bool init(Message &response, Player *player);
 
   // join error
-  const string joinError(PlayerPtr &player);
+  const string joinError(Player *player);
 
   // join the game
-  bool join(Message &response, PlayerPtr &player, const string &str);
+  bool join(Message &response, Player *player, const string &str);
 
   // set the players nicname
-  bool nic(Message &response, PlayerPtr &player, const string &str);
+  bool nic(Message &response, Player *player, const string &str);
 
   // the player takes cards from the pile
-  bool pickup(Message &response, PlayerPtr &player, string count);
+  bool pickup(Message &response, Player *player, string count);
 
   // takes the given hand from the player and adds to the pile
-  bool putdown(Message &response, PlayerPtr &player, const Hand &hand);
+  bool putdown(Message &response, Player *player, const char *data, size_t len);
+  bool putdown(Message &response, Player *player, const Hand &hand);
 
   // enter a different play roon
-  bool room(Message &response, PlayerPtr &player, const string &str);
+  bool room(Message &response, Player *player, const string &str);
 
   // shuffle the deck
-  bool shuffle(Message &response, PlayerPtr &player, const string &str);
+  bool shuffle(Message &response, Player *player, const string &str);
 
   // skip turn
-  bool skip(Message &response, PlayerPtr &player);
+  bool skip(Message &response, Player *player);
+
+  // start using deltas, sending the game in full
+  bool sync(Message &response, Player *player);
 
   // the game players including lurkers
-  vector<unique_ptr<Player>> _players;
+  Players _players;
 
   // the play rooms
   Room _rooms[numRooms];
@@ -0,0 +1,89 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include <string.h>
+#include "histogram.h"
+
+static const int subBucketBits = 5;
+static const int subBuckets = 1 << subBucketBits;
+static const int halfBuckets = subBuckets / 2;
+
+static int bucketOf(uint64_t value) {
+  int result;
+  if (value < (uint64_t)subBuckets) {
+    result = (int)value;
+  } else {
+    int exponent = (63 - __builtin_clzll(value)) - (subBucketBits - 1);
+    result = exponent * halfBuckets + (int)(value >> exponent);
+  }
+  return result < histogramBuckets ? result : histogramBuckets - 1;
+}
+
+// the largest value held by the bucket
+static uint64_t highestOf(int bucket) {
+  uint64_t result;
+  if (bucket < subBuckets) {
+    result = bucket;
+  } else {
+    int exponent = bucket / halfBuckets - 1;
+    uint64_t mantissa = bucket % halfBuckets + halfBuckets;
+    result = ((mantissa + 1) << exponent) - 1;
+  }
+  return result;
+}
+
+// only the owning thread writes, so no read-modify-write is needed
+static void add(atomic<uint64_t> &value, uint64_t n) {
+  value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void Histogram::record(uint64_t value) {
+  add(_counts[bucketOf(value)], 1);
+  add(_count, 1);
+  add(_sum, value);
+  if (value > _max.load(memory_order_relaxed)) {
+    _max.store(value, memory_order_relaxed);
+  }
+}
+
+HistogramSnapshot::HistogramSnapshot() :
+  _count(0),
+  _sum(0),
+  _max(0) {
+  memset(_counts, 0, sizeof(_counts));
+}
+
+void HistogramSnapshot::add(const Histogram &histogram) {
+  for (int i = 0; i < histogramBuckets; i++) {
+    _counts[i] += histogram._counts[i].load(memory_order_relaxed);
+  }
+  _count += histogram._count.load(memory_order_relaxed);
+  _sum += histogram._sum.load(memory_order_relaxed);
+  uint64_t max = histogram._max.load(memory_order_relaxed);
+  if (max > _max) {
+    _max = max;
+  }
+}
+
+uint64_t HistogramSnapshot::quantile(double q) const {
+  uint64_t result = 0;
+  uint64_t total = 0;
+  for (int i = 0; i < histogramBuckets; i++) {
+    total += _counts[i];
+  }
+  if (total != 0) {
+    uint64_t rank = (uint64_t)(q * total + 0.5);
+    uint64_t seen = 0;
+    int i = 0;
+    rank = rank == 0 ? 1 : rank;
+    while (i < histogramBuckets && (seen += _counts[i]) < rank) {
+      i++;
+    }
+    result = highestOf(i < histogramBuckets ? i : histogramBuckets - 1);
+    result = result < _max ? result : _max;
+  }
+  return result;
+}
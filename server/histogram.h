@@ -0,0 +1,47 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+using namespace std;
+
+//
+// HDR style log-linear buckets: values below 32 have a bucket each, above that every
+// power of two is split into 16 buckets, keeping each bucket within 1/16 of its value.
+// nanosecond values up to 2^40 (about 18 minutes) are kept, longer ones land in the
+// last bucket
+//
+static const int histogramBuckets = 592;
+
+// recorded by a single thread, read by any
+struct Histogram {
+  // adds the value, only called by the owning thread
+  void record(uint64_t value);
+
+  atomic<uint64_t> _counts[histogramBuckets];
+  atomic<uint64_t> _count;
+  atomic<uint64_t> _sum;
+  atomic<uint64_t> _max;
+};
+
+// the totals of any number of histograms
+struct HistogramSnapshot {
+  HistogramSnapshot();
+
+  // adds the histogram's current values
+  void add(const Histogram &histogram);
+
+  // returns the highest value equivalent to the given quantile, 0 when empty
+  uint64_t quantile(double q) const;
+
+  uint64_t _counts[histogramBuckets];
+  uint64_t _count;
+  uint64_t _sum;
+  uint64_t _max;
+};
@@ -0,0 +1,226 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include <stdlib.h>
+#if defined(__SSE2__)
+ #include <emmintrin.h>
+#endif
+#include "allocs.h"
+#include "json.h"
+#include "metrics.h"
+#include "utils.h"
+
+// whether the byte must be escaped within a JSON string
+static inline bool special(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+// the number of bytes before the first needing an escape
+static size_t plainRun(const char *data, size_t len) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  // compare sixteen bytes at a time, chat and names rarely need anything escaped
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+    // unsigned min(c, 0x1f) == c only for the control characters
+    __m128i found = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk),
+                                 _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                              _mm_cmpeq_epi8(chunk, backslash)));
+    if (_mm_movemask_epi8(found) != 0) {
+      // the bytes below find which
+      break;
+    }
+  }
+#endif
+  while (i < len && !special(data[i])) {
+    i++;
+  }
+  return i;
+}
+
+size_t jsonEscape(char *out, const char *data, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  char *next = out;
+  size_t i = 0;
+  while (i < len) {
+    size_t plain = plainRun(data + i, len - i);
+    memcpy(next, data + i, plain);
+    next += plain;
+    i += plain;
+    if (i < len) {
+      unsigned char c = data[i++];
+      *next++ = '\\';
+      switch (c) {
+      case '"': *next++ = '"'; break;
+      case '\\': *next++ = '\\'; break;
+      case '\b': *next++ = 'b'; break;
+      case '\f': *next++ = 'f'; break;
+      case '\n': *next++ = 'n'; break;
+      case '\r': *next++ = 'r'; break;
+      case '\t': *next++ = 't'; break;
+      default:
+        *next++ = 'u';
+        *next++ = '0';
+        *next++ = '0';
+        *next++ = hex[c >> 4];
+        *next++ = hex[c & 0xf];
+        break;
+      }
+    }
+  }
+  return next - out;
+}
+
+void jsonEscape(string &out, const char *data, size_t len) {
+  size_t start = out.length();
+  out.resize(start + len * maxEscape);
+  out.resize(start + jsonEscape(&out[start], data, len));
+}
+
+size_t formatInt(char *out, int value) {
+  size_t result = 0;
+  if (value < 0) {
+    out[result++] = '-';
+  }
+  return result + formatUint(out + result, value < 0 ? 0u - (unsigned int)value : (unsigned int)value);
+}
+
+size_t formatUint(char *out, uint64_t value) {
+  char digits[20];
+  size_t result = 0;
+  int count = 0;
+  do {
+    digits[count++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  while (count > 0) {
+    out[result++] = digits[--count];
+  }
+  return result;
+}
+
+JsonWriter::JsonWriter(size_t capacity) :
+  _block(nullptr),
+  _len(0),
+  _initial(capacity != 0 ? capacity : 1),
+  _capacity(_initial),
+  _failed(false) {
+}
+
+JsonWriter::~JsonWriter() {
+  free(_block);
+}
+
+char *JsonWriter::reserve(size_t len) {
+  char *result = nullptr;
+  if (!_failed) {
+    if (_block == nullptr || _len + len > _capacity) {
+      // allocated on first use, then doubled
+      size_t capacity = _block == nullptr ? _capacity : _capacity * 2;
+      while (capacity < _len + len) {
+        capacity *= 2;
+      }
+      unsigned char *block = (unsigned char *)realloc(_block, Frame::headroom() + capacity);
+      allocRecord(Frame::headroom() + capacity);
+      if (block != nullptr) {
+        _block = block;
+        _capacity = capacity;
+      } else {
+        log("OOM: dropping frame\n");
+        metric(kAllocFailures);
+        _failed = true;
+      }
+    }
+    if (!_failed) {
+      result = (char *)_block + Frame::headroom() + _len;
+    }
+  }
+  return result;
+}
+
+void JsonWriter::raw(const char *json, size_t len) {
+  char *out = reserve(len);
+  if (out != nullptr) {
+    memcpy(out, json, len);
+    _len += len;
+  }
+}
+
+void JsonWriter::text(const char *data, size_t len) {
+  char *out = reserve(len * maxEscape + 2);
+  if (out != nullptr) {
+    out[0] = '"';
+    size_t escaped = jsonEscape(out + 1, data, len);
+    out[escaped + 1] = '"';
+    _len += escaped + 2;
+  }
+}
+
+void JsonWriter::number(int value) {
+  char *out = reserve(11);
+  if (out != nullptr) {
+    _len += formatInt(out, value);
+  }
+}
+
+void JsonWriter::number(uint64_t value) {
+  char *out = reserve(20);
+  if (out != nullptr) {
+    _len += formatUint(out, value);
+  }
+}
+
+void JsonWriter::name(const char *name, bool next) {
+  if (next) {
+    raw(',');
+  }
+  raw('"');
+  raw(name, strlen(name));
+  raw("\":", 2);
+}
+
+void JsonWriter::field(const char *name, const string &value, bool next) {
+  this->name(name, next);
+  text(value);
+}
+
+void JsonWriter::field(const char *name, int value, bool next) {
+  this->name(name, next);
+  number(value);
+}
+
+void JsonWriter::fieldJson(const char *name, const string &json, bool next) {
+  this->name(name, next);
+  raw(json);
+}
+
+Frame *JsonWriter::frame() {
+  Frame *result = nullptr;
+  if (!_failed && reserve(0) != nullptr) {
+    if (_capacity - _len > 256) {
+      // escaping reserves for the worst case, return what the frame won't use
+      void *block = realloc(_block, Frame::headroom() + _len);
+      if (block != nullptr) {
+        _block = (unsigned char *)block;
+      }
+    }
+    result = Frame::place(_block, _len, false);
+    _block = nullptr;
+  }
+  free(_block);
+  _block = nullptr;
+  _len = 0;
+  _capacity = _initial;
+  _failed = false;
+  return result;
+}
+
+string JsonWriter::str() const {
+  return _block != nullptr ? string((const char *)_block + Frame::headroom(), _len) : string();
+}
@@ -0,0 +1,85 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <string>
+#include <stdint.h>
+#include <string.h>
+#include "message.h"
+
+using namespace std;
+
+// the most bytes escaping can turn one byte into, a control character as \u00XX
+static const size_t maxEscape = 6;
+
+// writes the text escaped for a JSON string, without the quotes, returns the bytes
+// written. out needs room for len * maxEscape bytes
+size_t jsonEscape(char *out, const char *data, size_t len);
+
+// appends the text escaped for a JSON string, without the quotes
+void jsonEscape(string &out, const char *data, size_t len);
+
+// writes the number as decimal, returns the bytes written. out needs room for 11 bytes
+size_t formatInt(char *out, int value);
+
+// writes the number as decimal, returns the bytes written. out needs room for 20 bytes
+size_t formatUint(char *out, uint64_t value);
+
+//
+// appends JSON straight into the memory of a text frame. the block starts with room for
+// the Frame and LWS_PRE, grows as it's written, and becomes the frame when done so the
+// payload is never copied. commas are written by the caller, as with field()
+//
+struct JsonWriter {
+  JsonWriter(size_t capacity = 512);
+  ~JsonWriter();
+
+  // appends JSON as is
+  void raw(char c) { raw(&c, 1); }
+  void raw(const char *json, size_t len);
+  void raw(const string &json) { raw(json.data(), json.length()); }
+
+  // appends a quoted, escaped string
+  void text(const char *data, size_t len);
+  void text(const string &value) { text(value.data(), value.length()); }
+
+  // appends a number
+  void number(int value);
+  void number(uint64_t value);
+
+  // appends "name": and the value as a string, preceded by a comma when next
+  void field(const char *name, const string &value, bool next);
+
+  // appends "name": and the number, preceded by a comma when next
+  void field(const char *name, int value, bool next);
+
+  // appends "name": and the JSON as is, preceded by a comma when next
+  void fieldJson(const char *name, const string &json, bool next);
+
+  // hands the buffer over as a text frame, nullptr when memory ran out. the writer
+  // starts again empty
+  Frame *frame();
+
+  // the JSON written so far
+  string str() const;
+
+private:
+  // returns where the next len bytes go, growing the block as needed. nullptr once
+  // memory runs out, after which nothing more is written
+  char *reserve(size_t len);
+
+  // appends "name": preceded by a comma when next
+  void name(const char *name, bool next);
+
+  unsigned char *_block;
+  size_t _len;
+
+  // the size first allocated, again for each frame
+  size_t _initial;
+  size_t _capacity;
+  bool _failed;
+};
@@ -7,22 +7,109 @@
 #include <libwebsockets.h>
 #include <string.h>
 #include <signal.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include "allocs.h"
+#include "assets.h"
 #include "controller.h"
 #include "message.h"
+#include "metrics.h"
+#include "pool.h"
+#include "profiler.h"
+#include "shard.h"
+#include "trace.h"
+#include "watchdog.h"
+
+static volatile int interrupted;
+static volatile sig_atomic_t reloadAssets;
+static volatile sig_atomic_t dumpStats;
+static int queueDepth = 32;
+static int highWater = 8;
+static int stallLimit = 15; /* seconds a session may take to write while frames wait */
+static size_t maxMessage = 4096;
+static int threads = 1;
+static bool sharedDeflate = false;
+static bool deflateOn = false; /* permessage-deflate offered with -z or -Z */
+static int stallMillis = 500;
+static const char *profileToken = nullptr;
+
+// the profiler's sampling rate, off the beat of any periodic timer
+static const int profileHz = 99;
+
+// the longest profile /profile will take
+static const int maxProfileSeconds = 60;
+
+// the protocol owning the shards, shared by every websocket protocol
+static const char *gameProtocol = "was-ws";
+
+// lws_protocols id of the compact binary protocol
+static const unsigned int binaryProtocol = 1;
+
+// the most bytes gathered into a single write
+static const size_t batchSize = 8192;
+
+// the static files, served from memory
+static const char *publicDir = "./public";
+static shared_ptr<const AssetCache> assets;
+
+// the thread reloading the assets after SIGHUP, and whether it's still running
+static thread assetLoader;
+static atomic<bool> assetsLoading;
+
+// the largest piece of a file written at once
+static const size_t chunkSize = 16384;
+
+// an http route made on request rather than read from the public directory
+struct Report {
+  const char *_path;
+  const char *_mime;
+  string (*_build)();
+};
 
-static int interrupted;
+static const Report reports[] = {
+  {"metrics", "text/plain; version=0.0.4", metricsText},
+  {"trace", "application/json", traceJson}
+};
 
 void sigint_handler(int /*sig*/) {
   interrupted = 1;
 }
 
+void sighup_handler(int /*sig*/) {
+  reloadAssets = 1;
+}
+
+void sigusr1_handler(int /*sig*/) {
+  dumpStats = 1;
+}
+
 // one of these is created for each client connecting to us
 struct Session {
-  Session *_sess;
-  Message _msg;
+  MessageQueue _queue; /* frames waiting to be written */
   lws *_wsi;
-  int _last; /* the last message number we sent */
   int _id;
+  int _shard; /* owner of the player's room */
+  int _tsi; /* the service thread handling the connection */
+  bool _deflate; /* frames are sent precompressed, bypassing the lws deflater */
+  bool _compress; /* lws permessage-deflate compresses each write */
+  bool _binary; /* negotiated the compact binary protocol */
+  bool _scheduled; /* a writeable callback is on the way */
+  unsigned char *_batch; /* LWS_PRE + batchSize bytes for coalescing frames */
+  unsigned char *_rx; /* the message being reassembled from fragments */
+  size_t _rxLen;
+  size_t _rxSize;
+  uint64_t _received; /* metricNow() at the first fragment of the message */
+};
+
+// one of these is created for each http connection
+struct Download {
+  shared_ptr<const AssetCache> *_cache; /* keeps the cache alive across a reload */
+  const string *_body; /* the encoding being sent */
+  string *_generated; /* a body made for this request, owned by the download */
+  size_t _sent;
+  bool _profiling; /* waiting on the timer to end the profile */
 };
 
 // one of these is created for each vhost our protocol is used with
@@ -30,17 +117,19 @@ struct HostContext {
   const lws_context *_context;
   const lws_vhost *_vhost;
   const lws_protocols *_protocol;
-  Session *_sess; /* linked-list of live pss*/
-  int _current; /* the current message number we are caching */
-  Controller *_controller;
+  Shard *_shards; /* game logic, one per service thread */
+  Outbox *_outboxes; /* frames from the shards, one per service thread */
+  unordered_map<int, Session *> *_sessions; /* live pss, one map per service thread */
+  BufferPool *_pools; /* fragment reassembly buffers, one per service thread */
+  int _count;
 };
 
 static const lws_http_mount mount = {
   /* .mount_next */   nullptr,   /* linked-list "next" */
   /* .mountpoint */   "/",    /* mountpoint URL */
-  /* .origin */     "./public",  /* serve from dir */
+  /* .origin */     nullptr,  /* served by the http protocol */
   /* .def */      "index.html", /* default filename */
-  /* .protocol */     nullptr,
+  /* .protocol */     "http",
   /* .cgienv */     nullptr,
   /* .extra_mimetypes */    nullptr,
   /* .interpret */    nullptr,
@@ -50,95 +139,629 @@ static const lws_http_mount mount = {
   /* .cache_reusable */   0,
   /* .cache_revalidate */   0,
   /* .cache_intermediaries */ 0,
-  /* .origin_protocol */    LWSMPRO_FILE, /* files in a dir */
+  /* .origin_protocol */    LWSMPRO_CALLBACK, /* files from the asset cache */
   /* .mountpoint_len */   1,    /* char count */
   /* .basic_auth_login_file */  nullptr,
   /* unused */ nullptr
 };
 
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+// the connection lws last set permessage-deflate up for on this thread. the extension is
+// constructed during the handshake, just ahead of ESTABLISHED
+static thread_local lws *deflateConstructed;
+
+// lws permessage-deflate, noting the connections using it and counting the bytes left of
+// each write, lws_write only reports the uncompressed length
+static int session_extension(lws_context *context, const lws_extension *ext, lws *wsi,
+                             enum lws_extension_callback_reasons reason, void *user, void *in, size_t len) {
+  int result = lws_extension_callback_pm_deflate(context, ext, wsi, reason, user, in, len);
+  if (reason == LWS_EXT_CB_CONSTRUCT && result == 0) {
+    deflateConstructed = wsi;
+  } else if (reason == LWS_EXT_CB_PAYLOAD_TX && result >= 0) {
+    metric(kBytesOut, ((lws_ext_pm_deflate_rx_ebufs *)in)->eb_out.len);
+  }
+  return result;
+}
+
+static const lws_extension extensions[] = {
+  { "permessage-deflate",
+    session_extension,
+    "permessage-deflate; client_no_context_takeover; client_max_window_bits"
+  },
+  { nullptr, nullptr, nullptr } /* terminator */
+};
+#endif
+
+// whether the client negotiated permessage-deflate in a way the shared frames can honour
+static bool session_deflate(lws *wsi) {
+  bool result = false;
+  int len = lws_hdr_total_length(wsi, WSI_TOKEN_EXTENSIONS);
+  if (sharedDeflate && len > 0) {
+    string offer(len + 1, '\0');
+    if (lws_hdr_copy(wsi, &offer[0], len + 1, WSI_TOKEN_EXTENSIONS) > 0) {
+      // a fresh stream per message suits any context takeover but not a reduced server window
+      result = (offer.find("permessage-deflate") != string::npos &&
+                offer.find("server_max_window_bits") == string::npos);
+    }
+  }
+  return result;
+}
+
+// copies the frame, header and all, into the batch at offset. returns the new end or 0 when full
+static size_t session_append(Session *sess, size_t offset, Frame *frame) {
+  size_t result = 0;
+  if (sess->_compress) {
+    // raw writes would bypass the lws deflater, so each frame is written alone
+  } else if (sess->_deflate) {
+    Frame *deflated = frame->deflated();
+    if (deflated != nullptr && offset + deflated->_len <= batchSize) {
+      memcpy(sess->_batch + LWS_PRE + offset, deflated->_data + LWS_PRE, deflated->_len);
+      result = offset + deflated->_len;
+    }
+  } else if (offset + frame->wireLen() <= batchSize) {
+    memcpy(sess->_batch + LWS_PRE + offset, frame->wire(), frame->wireLen());
+    result = offset + frame->wireLen();
+  }
+  return result;
+}
+
+// write the frame, returns false when the connection failed
+static bool session_write(Session *sess, Frame *frame) {
+  bool result;
+  if (sess->_deflate) {
+    Frame *deflated = frame->deflated();
+    result = (deflated != nullptr &&
+              lws_write(sess->_wsi, deflated->_data + LWS_PRE, deflated->_len, LWS_WRITE_RAW) == deflated->_len);
+    if (result) {
+      metric(kBytesOut, deflated->_len);
+    }
+  } else if (sess->_compress && frame->_len > 0) {
+    // lws compresses into its own buffer with the header, the shared frame is only read.
+    // the extension counts the bytes sent
+    lws_write_protocol type = frame->_binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT;
+    result = (lws_write(sess->_wsi, frame->_data + LWS_PRE, frame->_len, type) == frame->_len);
+  } else {
+    // the header is already in place, other service threads may be sending the same bytes
+    result = (lws_write(sess->_wsi, frame->wire(), frame->wireLen(), LWS_WRITE_RAW) == frame->wireLen());
+    if (result) {
+      metric(kBytesOut, frame->wireLen());
+    }
+  }
+  return result;
+}
+
+// count the payload and record the time from the message causing the frame until its write
+static void session_latency(Frame *frame, uint64_t now) {
+  metric(kBytesPayload, frame->_len);
+  uint64_t origin = frame->_origin.load(memory_order_relaxed);
+  if (origin != 0 && now > origin) {
+    metricWritten(now - origin);
+  }
+}
+
+// while frames wait the session has stallLimit to write something, otherwise lws closes
+// it. armed by the queue filling and each write, so a quiet room still enforces it
+static void session_progress(Session *sess) {
+  if (sess->_queue.empty()) {
+    lws_set_timeout(sess->_wsi, NO_PENDING_TIMEOUT, 0);
+  } else {
+    lws_set_timeout(sess->_wsi, PENDING_TIMEOUT_USER_OK, stallLimit);
+  }
+}
+
+// write as many pending frames as the socket will take, returns false when the connection failed
+static bool session_flush(Session *sess) {
+  TraceSpan span("write", sess->_id);
+  bool result = true;
+  bool written = false;
+  while (result && !sess->_queue.empty() && !lws_send_pipe_choked(sess->_wsi)) {
+    Frame *frame = sess->_queue.pop();
+    uint64_t now = metricNow();
+    size_t used = sess->_queue.empty() ? 0 : session_append(sess, 0, frame);
+    session_latency(frame, now);
+    if (used == 0) {
+      result = session_write(sess, frame);
+      frame->release();
+    } else {
+      // gather the following frames into the same write. uncompressed frames remain
+      // valid when permessage-deflate was negotiated
+      frame->release();
+      size_t next;
+      while (!sess->_queue.empty() && (next = session_append(sess, used, sess->_queue.peek())) != 0) {
+        used = next;
+        frame = sess->_queue.pop();
+        session_latency(frame, now);
+        frame->release();
+      }
+      result = (lws_write(sess->_wsi, sess->_batch + LWS_PRE, used, LWS_WRITE_RAW) == (int)used);
+      if (result) {
+        metric(kBytesOut, used);
+      }
+    }
+    written = true;
+  }
+  if (written) {
+    session_progress(sess);
+  }
+  return result;
+}
+
+// ask for a writeable callback unless one is already on the way
+static void session_schedule(Session *sess) {
+  if (!sess->_scheduled) {
+    sess->_scheduled = true;
+    lws_callback_on_writable(sess->_wsi);
+  }
+}
+
+// returns the index of the shard owning the room
+static int shard_of(HostContext *vhd, int room) {
+  return room % vhd->_count;
+}
+
 static void session_closed(Session *sess, HostContext *vhd) {
-  sess->_msg.destroy();
+  // remove our closing pss from the live pss, frames still on the way are dropped
+  vhd->_sessions[sess->_tsi].erase(sess->_id);
+  vhd->_pools[sess->_tsi].release(sess->_rx, sess->_rxSize);
+  sess->_rx = nullptr;
+  vhd->_shards[sess->_shard].post(new Command(kClose, sess->_id));
+  sess->_queue.destroy();
+  free(sess->_batch);
+  sess->_batch = nullptr;
+}
 
-  const Message message = vhd->_controller->destroySession(sess->_id);
+static void session_received(Session *sess, HostContext *vhd, const unsigned char *in, size_t len) {
+  int room = Controller::requestedRoom(in, len, sess->_binary);
+  int shard = room != -1 ? shard_of(vhd, room) : sess->_shard;
+  Command *command = new Command(shard != sess->_shard ? kDetach : kReceive, sess->_id);
+  command->_data.assign((const char *)in, len);
+  command->_received = sess->_received;
+  command->_shard = shard;
+  if (shard != sess->_shard) {
+    // the room belongs to another shard, which holds our messages until the player arrives
+    vhd->_shards[shard].post(new Command(kExpect, sess->_id));
+    vhd->_shards[sess->_shard].post(command);
+    sess->_shard = shard;
+  } else {
+    vhd->_shards[sess->_shard].post(command);
+  }
+}
 
-  // remove our closing pss from the list of live pss
-  lws_ll_fwd_remove(Session, _sess, sess, vhd->_sess);
+// collect the fragment, dispatching once the message is complete. returns false when the
+// message is too large
+static bool session_fragment(Session *sess, HostContext *vhd, const unsigned char *in, size_t len) {
+  bool result = true;
+  bool first = lws_is_first_fragment(sess->_wsi);
+  bool final = lws_is_final_fragment(sess->_wsi);
+  BufferPool &pool = vhd->_pools[sess->_tsi];
+  metric(kBytesIn, len);
+  if (first) {
+    sess->_received = metricNow();
+  }
+  if (first && final) {
+    // the whole message in one piece
+    session_received(sess, vhd, in, len);
+  } else {
+    if (first) {
+      sess->_rxLen = 0;
+    }
+    size_t size = sess->_rxLen + len;
+    if (size > maxMessage) {
+      result = false;
+    } else if (size > sess->_rxSize) {
+      // move up to the next size class
+      size_t capacity;
+      unsigned char *rx = pool.acquire(max(size, sess->_rxSize * 2), capacity);
+      if (rx == nullptr) {
+        result = false;
+      } else {
+        if (sess->_rxLen) {
+          memcpy(rx, sess->_rx, sess->_rxLen);
+        }
+        pool.release(sess->_rx, sess->_rxSize);
+        sess->_rx = rx;
+        sess->_rxSize = capacity;
+      }
+    }
+    if (result) {
+      memcpy(sess->_rx + sess->_rxLen, in, len);
+      sess->_rxLen = size;
+      if (final) {
+        session_received(sess, vhd, sess->_rx, sess->_rxLen);
+        sess->_rxLen = 0;
+        pool.release(sess->_rx, sess->_rxSize);
+        sess->_rx = nullptr;
+        sess->_rxSize = 0;
+      }
+    }
+  }
+  return result;
+}
+
+// queue the frames the shards have produced for our sessions
+static void session_deliver(HostContext *vhd, int tsi) {
+  Delivery *delivery;
+  while ((delivery = vhd->_outboxes[tsi].pop()) != nullptr) {
+    auto it = vhd->_sessions[tsi].find(delivery->_sessionId);
+    if (it != vhd->_sessions[tsi].end()) {
+      Session *sess = it->second;
+      bool idle = sess->_queue.empty();
+      int superseded = sess->_queue._superseded;
+      if (!sess->_queue.push(delivery->_frame)) {
+        lwsl_user("queue full: dropped frame for [%d] (%d dropped)\n", sess->_id, sess->_queue._dropped);
+        metric(kFramesDropped);
+      }
+      if (sess->_queue._superseded != superseded) {
+        metric(kFramesSuperseded, sess->_queue._superseded - superseded);
+      }
+      if (idle) {
+        // one stalled client should not hold frames and buffers indefinitely
+        session_progress(sess);
+      }
+      session_schedule(sess);
+    }
+    delivery->_frame->release();
+    delete delivery;
+  }
+}
+
+// loads the public directory into a new cache, requests in flight keep the old one
+static void assets_load() {
+  shared_ptr<AssetCache> cache = make_shared<AssetCache>();
+  if (cache->load(publicDir)) {
+    lwsl_user("Loaded %d assets from %s\n", cache->size(), publicDir);
+    atomic_store(&assets, shared_ptr<const AssetCache>(cache));
+  } else {
+    lwsl_err("failed to load assets from %s\n", publicDir);
+  }
+}
 
-  // tell the other players this one has left
-  lws_start_foreach_llp(Session **, psess, vhd->_sess) {
-    (*psess)->_msg = message;
-    lws_callback_on_writable((*psess)->_wsi);
+// reloads the assets on a helper thread, compressing them would stall a service thread's
+// connections. returns false while the previous reload is still running
+static bool assets_reload() {
+  bool result = !assetsLoading.exchange(true);
+  if (result) {
+    if (assetLoader.joinable()) {
+      assetLoader.join();
+    }
+    assetLoader = thread([]() {
+      assets_load();
+      assetsLoading = false;
+    });
   }
-  lws_end_foreach_llp(psess, _sess);
-  vhd->_current++;
+  return result;
+}
+
+// the variant of the asset for the client's accepted encodings
+static const string *asset_encoding(lws *wsi, const Asset *asset, const char **encoding) {
+  const string *result = &asset->_body;
+  *encoding = nullptr;
+  char accept[256];
+  if (lws_hdr_copy(wsi, accept, sizeof(accept), WSI_TOKEN_HTTP_ACCEPT_ENCODING) > 0) {
+    if (!asset->_brotli.empty() && strstr(accept, "br") != nullptr) {
+      result = &asset->_brotli;
+      *encoding = "br";
+    } else if (!asset->_gzip.empty() && strstr(accept, "gzip") != nullptr) {
+      result = &asset->_gzip;
+      *encoding = "gzip";
+    }
+  }
+  return result;
+}
+
+// whether the client already holds the asset's variant for the encoding
+static bool asset_cached(lws *wsi, const Asset *asset, const char *encoding) {
+  char match[256];
+  return (lws_hdr_copy(wsi, match, sizeof(match), WSI_TOKEN_HTTP_IF_NONE_MATCH) > 0 &&
+          (strstr(match, asset->etag(encoding).c_str()) != nullptr || strcmp(match, "*") == 0));
+}
+
+// whether the url carries a content version, as in deck.png?v=..., which changes with the content
+static bool asset_versioned(lws *wsi) {
+  char version[64];
+  return lws_get_urlarg_by_name(wsi, "v=", version, sizeof(version)) != nullptr;
+}
+
+// send the headers for the asset, returns non-zero on error
+static int asset_headers(lws *wsi, const Asset *asset, unsigned int status, const string *body, const char *encoding) {
+  unsigned char buffer[LWS_PRE + 1024];
+  unsigned char *start = buffer + LWS_PRE;
+  unsigned char *p = start;
+  unsigned char *end = buffer + sizeof(buffer) - 1;
+  const char *cacheControl = (asset->_immutable || asset_versioned(wsi)) ? "public, max-age=31536000, immutable" : "no-cache";
+  const string &etag = asset->etag(encoding);
+  int result =
+    lws_add_http_common_headers(wsi, status, asset->_mime, body != nullptr ? body->length() : 0, &p, end) ||
+    lws_add_http_header_by_name(wsi, (const unsigned char *)"etag:",
+                                (const unsigned char *)etag.c_str(), etag.length(), &p, end) ||
+    lws_add_http_header_by_name(wsi, (const unsigned char *)"cache-control:",
+                                (const unsigned char *)cacheControl, strlen(cacheControl), &p, end) ||
+    lws_add_http_header_by_name(wsi, (const unsigned char *)"vary:",
+                                (const unsigned char *)"Accept-Encoding", 15, &p, end);
+  if (!result && encoding != nullptr) {
+    result = lws_add_http_header_by_name(wsi, (const unsigned char *)"content-encoding:",
+                                         (const unsigned char *)encoding, strlen(encoding), &p, end);
+  }
+  if (!result) {
+    result = lws_finalize_write_http_header(wsi, start, &p, end);
+  }
+  return result;
+}
+
+// returns the report for the request path, or nullptr for a file
+static const Report *report_find(const char *path) {
+  const Report *result = nullptr;
+  for (const Report &next : reports) {
+    if (strcmp(path + strspn(path, "/"), next._path) == 0) {
+      result = &next;
+      break;
+    }
+  }
+  return result;
+}
+
+// send the headers for a generated body, returns non-zero on error
+static int report_headers(lws *wsi, const char *mime, const string &body) {
+  unsigned char buffer[LWS_PRE + 512];
+  unsigned char *start = buffer + LWS_PRE;
+  unsigned char *p = start;
+  unsigned char *end = buffer + sizeof(buffer) - 1;
+  int result =
+    lws_add_http_common_headers(wsi, HTTP_STATUS_OK, mime, body.length(), &p, end) ||
+    lws_add_http_header_by_name(wsi, (const unsigned char *)"cache-control:",
+                                (const unsigned char *)"no-store", 8, &p, end);
+  if (!result) {
+    result = lws_finalize_write_http_header(wsi, start, &p, end);
+  }
+  return result;
+}
+
+// sends the generated body, which the download then owns. returns non-zero on error
+static int report_send(lws *wsi, Download *download, const char *mime, string *body) {
+  int result = report_headers(wsi, mime, *body);
+  if (result) {
+    delete body;
+  } else {
+    download->_generated = body;
+    download->_body = body;
+    download->_sent = 0;
+    lws_callback_on_writable(wsi);
+  }
+  return result;
+}
+
+// whether the request is for a cpu profile
+static bool profile_requested(const char *path) {
+  return strcmp(path + strspn(path, "/"), "profile") == 0;
+}
+
+// starts profiling for ?seconds=n when ?token= matches -P, the timer sends the result
+static int profile_begin(lws *wsi, Download *download) {
+  char token[128];
+  char seconds[16];
+  const char *value = lws_get_urlarg_by_name(wsi, "token=", token, sizeof(token));
+  unsigned int status = 0;
+  int result = 0;
+  if (profileToken == nullptr || value == nullptr || strcmp(value, profileToken) != 0) {
+    status = HTTP_STATUS_FORBIDDEN;
+  } else if (!profileStart(profileHz)) {
+    // one profile at a time
+    status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+  } else {
+    value = lws_get_urlarg_by_name(wsi, "seconds=", seconds, sizeof(seconds));
+    int duration = min(max(1, value != nullptr ? atoi(value) : 10), maxProfileSeconds);
+    lwsl_user("Profiling for %ds\n", duration);
+    download->_profiling = true;
+    lws_set_timer_usecs(wsi, (lws_usec_t)duration * LWS_US_PER_SEC);
+  }
+  if (status != 0) {
+    lws_return_http_status(wsi, status, nullptr);
+    result = lws_http_transaction_completed(wsi) ? -1 : 0;
+  }
+  return result;
+}
+
+static void download_done(Download *download) {
+  delete download->_cache;
+  delete download->_generated;
+  if (download->_profiling) {
+    // the client left before the profile ended
+    profileStop();
+    download->_profiling = false;
+  }
+  download->_cache = nullptr;
+  download->_generated = nullptr;
+  download->_body = nullptr;
+}
+
+// serves the public directory from the asset cache
+static int http_callback(lws *wsi, lws_callback_reasons reason, void *user, void *in, size_t len) {
+  WatchBusy busy;
+  Download *download = (Download *)user;
+  int result = 0;
+
+  switch (reason) {
+  case LWS_CALLBACK_HTTP: {
+    shared_ptr<const AssetCache> cache = atomic_load(&assets);
+    const Asset *asset = cache ? cache->find((const char *)in) : nullptr;
+    const Report *report = report_find((const char *)in);
+    if (profile_requested((const char *)in)) {
+      result = profile_begin(wsi, download);
+    } else if (report != nullptr) {
+      result = report_send(wsi, download, report->_mime, new string(report->_build()));
+    } else if (asset == nullptr) {
+      lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, nullptr);
+      result = lws_http_transaction_completed(wsi) ? -1 : 0;
+    } else {
+      // validators are per encoding, so the variant is chosen first
+      const char *encoding;
+      const string *body = asset_encoding(wsi, asset, &encoding);
+      if (asset_cached(wsi, asset, encoding)) {
+        if (asset_headers(wsi, asset, HTTP_STATUS_NOT_MODIFIED, nullptr, encoding)) {
+          result = 1;
+        } else {
+          result = lws_http_transaction_completed(wsi) ? -1 : 0;
+        }
+      } else if (asset_headers(wsi, asset, HTTP_STATUS_OK, body, encoding)) {
+        result = 1;
+      } else {
+        download->_cache = new shared_ptr<const AssetCache>(cache);
+        download->_body = body;
+        download->_sent = 0;
+        lws_callback_on_writable(wsi);
+      }
+    }
+    break;
+  }
+
+  case LWS_CALLBACK_HTTP_WRITEABLE:
+    if (download->_body != nullptr) {
+      unsigned char buffer[LWS_PRE + chunkSize];
+      size_t n = min(chunkSize, download->_body->length() - download->_sent);
+      bool final = (download->_sent + n == download->_body->length());
+      memcpy(buffer + LWS_PRE, download->_body->data() + download->_sent, n);
+      if (lws_write(wsi, buffer + LWS_PRE, n, final ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) != (int)n) {
+        result = 1;
+      } else if (final) {
+        download_done(download);
+        result = lws_http_transaction_completed(wsi) ? -1 : 0;
+      } else {
+        download->_sent += n;
+        lws_callback_on_writable(wsi);
+      }
+    }
+    break;
+
+  case LWS_CALLBACK_TIMER:
+    if (download->_profiling) {
+      download->_profiling = false;
+      result = report_send(wsi, download, "text/plain", new string(profileStop()));
+    }
+    break;
+
+  case LWS_CALLBACK_CLOSED_HTTP:
+    download_done(download);
+    break;
+
+  default:
+    result = lws_callback_http_dummy(wsi, reason, user, in, len);
+    break;
+  }
+  return result;
 }
 
 static int callback(lws *wsi, lws_callback_reasons reason, void *user, void *in, size_t len) {
+  WatchBusy busy;
   Session *sess = (Session *)user;
-  HostContext *vhd = (HostContext *)
-    lws_protocol_vh_priv_get(lws_get_vhost(wsi), lws_get_protocol(wsi));
+  // every protocol plays in the same rooms, so they all use the game protocol's context
+  const lws_protocols *game = lws_vhost_name_to_protocol(lws_get_vhost(wsi), gameProtocol);
+  bool owner = (game == lws_get_protocol(wsi));
+  HostContext *vhd = (HostContext *)lws_protocol_vh_priv_get(lws_get_vhost(wsi), game);
 
   switch (reason) {
   case LWS_CALLBACK_PROTOCOL_INIT:
+    if (!owner) {
+      break;
+    }
     vhd = (HostContext *)
       lws_protocol_vh_priv_zalloc(lws_get_vhost(wsi), lws_get_protocol(wsi), sizeof(HostContext));
     vhd->_context = lws_get_context(wsi);
     vhd->_protocol = lws_get_protocol(wsi);
     vhd->_vhost = lws_get_vhost(wsi);
-    vhd->_controller = new Controller();
+    vhd->_count = threads;
+    vhd->_outboxes = new Outbox[threads];
+    vhd->_sessions = new unordered_map<int, Session *>[threads];
+    vhd->_pools = new BufferPool[threads];
+    vhd->_shards = new Shard[threads];
+    for (int i = 0; i < threads; i++) {
+      vhd->_shards[i].start(lws_get_context(wsi), vhd->_shards, vhd->_outboxes);
+    }
     break;
 
   case LWS_CALLBACK_PROTOCOL_DESTROY:
-    delete vhd->_controller;
-    vhd->_controller = nullptr;
+    if (owner && vhd != nullptr && vhd->_shards != nullptr) {
+      for (int i = 0; i < vhd->_count; i++) {
+        vhd->_shards[i].stop();
+      }
+      for (int i = 0; i < vhd->_count; i++) {
+        session_deliver(vhd, i);
+      }
+      delete [] vhd->_shards;
+      delete [] vhd->_outboxes;
+      delete [] vhd->_sessions;
+      delete [] vhd->_pools;
+      vhd->_shards = nullptr;
+      vhd->_outboxes = nullptr;
+      vhd->_sessions = nullptr;
+      vhd->_pools = nullptr;
+    }
+    break;
+
+  case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+    if (owner && vhd != nullptr && vhd->_outboxes != nullptr) {
+      session_deliver(vhd, lws_get_tsi(wsi));
+    }
     break;
 
-  case LWS_CALLBACK_ESTABLISHED:
-    // add ourselves to the list of live pss held in the vhd
-    lws_ll_fwd_insert(sess, _sess, vhd->_sess);
-    sess->_msg.create();
+  case LWS_CALLBACK_ESTABLISHED: {
+    sess->_batch = (unsigned char *)malloc(LWS_PRE + batchSize);
+    if (!sess->_queue.create(queueDepth, min(highWater, queueDepth)) || sess->_batch == nullptr) {
+      // rejected before the session is known to anyone
+      lwsl_err("failed to allocate session buffers\n");
+      sess->_queue.destroy();
+      free(sess->_batch);
+      sess->_batch = nullptr;
+      return -1;
+    }
+    metric(kConnections);
     sess->_wsi = wsi;
-    sess->_last = vhd->_current;
-    sess->_id = vhd->_controller->createSession();
+    sess->_tsi = lws_get_tsi(wsi);
+    sess->_deflate = session_deflate(wsi);
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+    sess->_compress = (deflateConstructed == wsi && !sess->_deflate);
+    deflateConstructed = nullptr;
+#endif
+    sess->_binary = (lws_get_protocol(wsi)->id == binaryProtocol);
+    sess->_id = Controller::nextSessionId();
+    // new players start in the first room
+    sess->_shard = shard_of(vhd, 0);
+    // add ourselves to the live pss of this service thread
+    vhd->_sessions[sess->_tsi][sess->_id] = sess;
+    Command *command = new Command(kConnect, sess->_id);
+    command->_tsi = sess->_tsi;
+    command->_binary = sess->_binary;
+    vhd->_shards[sess->_shard].post(command);
     break;
+  }
 
   case LWS_CALLBACK_CLOSED:
-    session_closed(sess, vhd);
+    // _wsi is only set for sessions that were established
+    if (sess->_wsi != nullptr) {
+      metric(kDisconnections);
+      session_closed(sess, vhd);
+    }
     break;
 
   case LWS_CALLBACK_SERVER_WRITEABLE:
-    if (sess->_msg._data != nullptr && sess->_last != vhd->_current) {
-      // notice we allowed for LWS_PRE in the payload already
-      int m = lws_write(wsi, sess->_msg._data + LWS_PRE, sess->_msg._len, LWS_WRITE_TEXT);
-      if (m != sess->_msg._len) {
-        lwsl_err("ERROR %d writing to ws\n", m);
-        return -1;
-      }
-      sess->_last = vhd->_current;
+    sess->_scheduled = false;
+    if (!session_flush(sess)) {
+      lwsl_err("ERROR writing to ws [%d]\n", sess->_id);
+      return -1;
+    }
+    if (!sess->_queue.empty()) {
+      session_schedule(sess);
     }
     break;
 
-  case LWS_CALLBACK_RECEIVE:
-    if (vhd->_controller->handle((unsigned char *)in, len, sess->_msg, sess->_id)) {
-      if (sess->_msg.isBroadcast()) {
-        // let everybody know we want to write something on them as soon as they are ready
-        lws_start_foreach_llp(Session **, psess, vhd->_sess) {
-          if (vhd->_controller->isSameRoom((*psess)->_id, sess->_id)) {
-            if (*psess != sess) {
-              (*psess)->_msg = vhd->_controller->redact((*psess)->_id, sess->_msg);
-            }
-            lws_callback_on_writable((*psess)->_wsi);
-          }
-        }
-        lws_end_foreach_llp(psess, _sess);
-      } else {
-        lws_callback_on_writable(wsi);
-      }
-      vhd->_current++;
-    } else {
-      lwsl_user("OOM: dropping\n");
+  case LWS_CALLBACK_RECEIVE: {
+    TraceSpan span("receive", sess->_id);
+    if (!session_fragment(sess, vhd, (const unsigned char *)in, len)) {
+      lwsl_user("message too large: closing [%d]\n", sess->_id);
+      lws_close_reason(wsi, LWS_CLOSE_STATUS_MESSAGE_TOO_LARGE, nullptr, 0);
+      return -1;
     }
     break;
+  }
 
   default:
     break;
@@ -148,13 +771,19 @@ static int callback(lws *wsi, lws_callback_reasons reason, void *user, void *in,
 }
 
 static struct lws_protocols protocols[] = {
-  { "http", lws_callback_http_dummy, 0, 0, 0, 0, 0 },
+  { "http", http_callback, sizeof(Download), 0, 0, 0, 0 },
   { "was-ws",
     callback,
     sizeof(Session),
     128, // rx buffer size
     0, nullptr, 0
   },
+  { "was-bin",
+    callback,
+    sizeof(Session),
+    128, // rx buffer size
+    binaryProtocol, nullptr, 0
+  },
   { nullptr, nullptr, 0, 0, 0, 0, 0 } /* terminator */
 };
 
@@ -167,18 +796,105 @@ static const lws_retry_bo_t retry = {
   .jitter_percent = 0
 };
 
+// logs the latency percentiles and any allocation counts, a line at a time to suit the log buffer
+static void stats_dump() {
+  string report = latencyReport() + allocReport();
+  size_t start = 0;
+  size_t end;
+  lwsl_user("Stats:\n");
+  while ((end = report.find('\n', start)) != string::npos) {
+    lwsl_user("  %s\n", report.substr(start, end - start).c_str());
+    start = end + 1;
+  }
+  uint64_t payload = metricTotal(kBytesPayload);
+  uint64_t sent = metricTotal(kBytesOut);
+  if (deflateOn && payload != 0) {
+    // with permessage-deflate the bytes sent should fall well below the payload
+    lwsl_user("  sent %llu bytes for %llu payload bytes\n", (unsigned long long)sent, (unsigned long long)payload);
+    if (sent >= payload) {
+      lwsl_warn("permessage-deflate is on but nothing was compressed\n");
+    }
+  }
+}
+
+// runs the event loop for one service thread
+static void service(lws_context *context, int tsi) {
+  int n = 0;
+  traceThread("service");
+  watchThread("service");
+  while (n >= 0 && !interrupted) {
+    n = lws_service_tsi(context, 0, tsi);
+    if (tsi == 0 && reloadAssets && assets_reload()) {
+      reloadAssets = 0;
+    }
+    if (tsi == 0 && dumpStats) {
+      dumpStats = 0;
+      stats_dump();
+    }
+  }
+}
+
 int main(int argc, const char **argv) {
   lws_context_creation_info info;
   const char *p;
-  int n = 0;
   int logs = LLL_USER | LLL_ERR | LLL_WARN | LLL_NOTICE;
 
   signal(SIGINT, sigint_handler);
+  signal(SIGHUP, sighup_handler);
+  signal(SIGUSR1, sigusr1_handler);
 
   if ((p = lws_cmdline_option(argc, argv, "-d"))) {
     logs = atoi(p);
   }
 
+  if ((p = lws_cmdline_option(argc, argv, "-q"))) {
+    queueDepth = max(1, atoi(p));
+  }
+
+  if ((p = lws_cmdline_option(argc, argv, "-w"))) {
+    highWater = max(1, atoi(p));
+  }
+
+  if ((p = lws_cmdline_option(argc, argv, "-c"))) {
+    stallLimit = max(1, atoi(p));
+  }
+
+  if ((p = lws_cmdline_option(argc, argv, "-m"))) {
+    maxMessage = min((size_t)max(1, atoi(p)), BufferPool::maxSize);
+  }
+
+  if ((p = lws_cmdline_option(argc, argv, "-r"))) {
+    // the websocket protocols follow "http"
+    for (lws_protocols *protocol = protocols + 1; protocol->name != nullptr; protocol++) {
+      protocol->rx_buffer_size = max(128, atoi(p));
+    }
+  }
+
+  if ((p = lws_cmdline_option(argc, argv, "-W"))) {
+    // 0 turns the watchdog off
+    stallMillis = max(0, atoi(p));
+  }
+
+  if ((p = lws_cmdline_option(argc, argv, "-T"))) {
+    // spans kept per thread for /trace
+    int events = atoi(p);
+    traceStart(events > 0 ? events : 65536);
+    lwsl_user("Tracing, /trace returns the spans since the last request\n");
+  }
+
+  if ((p = lws_cmdline_option(argc, argv, "-P"))) {
+    // /profile?seconds=n&token= samples the cpu for n seconds
+    profileToken = p;
+    lwsl_user("Profiling enabled on /profile\n");
+  }
+
+  if ((p = lws_cmdline_option(argc, argv, "-t"))) {
+    threads = max(1, atoi(p));
+#if defined(LWS_MAX_SMP)
+    threads = min(threads, LWS_MAX_SMP);
+#endif
+  }
+
   lws_set_log_level(logs, nullptr);
   lwsl_user("Kibitzer | visit http://localhost:7681 (-s = use TLS / https)\n");
 
@@ -187,6 +903,19 @@ int main(int argc, const char **argv) {
   info.mounts = &mount;
   info.protocols = protocols;
   info.vhost_name = "localhost";
+  info.count_threads = threads;
+
+  if (lws_cmdline_option(argc, argv, "-z") || lws_cmdline_option(argc, argv, "-Z")) {
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+    // -Z compresses each frame once and shares it between recipients
+    sharedDeflate = (lws_cmdline_option(argc, argv, "-Z") != nullptr);
+    deflateOn = true;
+    lwsl_user("Using permessage-deflate%s\n", sharedDeflate ? " with shared frames" : "");
+    info.extensions = extensions;
+#else
+    lwsl_warn("libwebsockets built without extensions, permessage-deflate unavailable\n");
+#endif
+  }
   info.options = LWS_SERVER_OPTION_HTTP_HEADERS_SECURITY_BEST_PRACTICES_ENFORCE;
 
   if (lws_cmdline_option(argc, argv, "-s")) {
@@ -204,14 +933,32 @@ int main(int argc, const char **argv) {
     info.retry_and_idle_policy = &retry;
   }
 
+  assets_load();
+
   lws_context *context = lws_create_context(&info);
   if (!context) {
     lwsl_err("lws init failed\n");
     return 1;
   }
 
-  while (n >= 0 && !interrupted) {
-    n = lws_service(context, 0);
+  lwsl_user("Service threads: %d\n", threads);
+  if (stallMillis > 0) {
+    lwsl_user("Reporting work taking over %dms\n", stallMillis);
+    watchStart((uint64_t)stallMillis * 1000000);
+  }
+  vector<thread> workers;
+  for (int tsi = 1; tsi < threads; tsi++) {
+    workers.push_back(thread(service, context, tsi));
+  }
+  service(context, 0);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  if (assetLoader.joinable()) {
+    assetLoader.join();
+  }
+  if (stallMillis > 0) {
+    watchStop();
   }
 
   lws_context_destroy(context);
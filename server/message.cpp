@@ -5,12 +5,146 @@
 //
 
 #include <libwebsockets.h>
+#include <new>
+#include <zlib.h>
+#include "allocs.h"
 #include "message.h"
+#include "metrics.h"
+#include "utils.h"
+
+// writes the websocket header for a final text or binary frame, returns its length
+static int frameHeader(unsigned char *header, size_t len, bool compressed, bool binary) {
+  int result;
+  header[0] = (binary ? 0x82 : 0x81) | (compressed ? 0x40 : 0);
+  if (len < 126) {
+    header[1] = len;
+    result = 2;
+  } else if (len < 0x10000) {
+    header[1] = 126;
+    header[2] = len >> 8;
+    header[3] = len;
+    result = 4;
+  } else {
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) {
+      header[2 + i] = (uint64_t)len >> (56 - (i * 8));
+    }
+    result = 10;
+  }
+  return result;
+}
+
+static_assert(LWS_PRE >= maxFrameHeader, "the websocket header fits in the headroom");
+
+// compress the payload as a single permessage-deflate message (RFC 7692) with a fresh
+// stream, so it is valid whatever context takeover the client negotiated
+static Frame *deflateFrame(const unsigned char *payload, size_t len, bool binary) {
+  Frame *result = nullptr;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+    size_t bound = deflateBound(&stream, len) + 16;
+    unsigned char *buffer = (unsigned char *)malloc(maxFrameHeader + bound);
+    allocRecord(maxFrameHeader + bound);
+    if (buffer != nullptr) {
+      stream.next_in = (Bytef *)payload;
+      stream.avail_in = len;
+      stream.next_out = buffer + maxFrameHeader;
+      stream.avail_out = bound;
+      if (deflate(&stream, Z_SYNC_FLUSH) == Z_OK && stream.avail_in == 0) {
+        // drop the 00 00 ff ff tail of the sync flush
+        size_t size = stream.total_out - 4;
+        bool compressed = (size < len);
+        if (!compressed) {
+          // not worth it, an uncompressed message is allowed too
+          size = len;
+          memcpy(buffer + maxFrameHeader, payload, len);
+        }
+        unsigned char header[maxFrameHeader];
+        int headerLen = frameHeader(header, size, compressed, binary);
+        unsigned char *framed = buffer + maxFrameHeader - headerLen;
+        memcpy(framed, header, headerLen);
+        result = Frame::create(framed, headerLen + size);
+      }
+      free(buffer);
+    } else {
+      log("OOM: deflating frame\n");
+      metric(kAllocFailures);
+    }
+    deflateEnd(&stream);
+  }
+  return result;
+}
+
+Frame *Frame::create(const unsigned char *data, size_t len, bool binary) {
+  // over-allocate by LWS_PRE, the payload follows the header
+  void *block = malloc(headroom() + len);
+  allocRecord(headroom() + len);
+  Frame *result = nullptr;
+  if (block != nullptr) {
+    memcpy((char *)block + headroom(), data, len);
+    result = place(block, len, binary);
+  } else {
+    log("OOM: dropping frame\n");
+    metric(kAllocFailures);
+  }
+  return result;
+}
+
+size_t Frame::headroom() {
+  return sizeof(Frame) + LWS_PRE;
+}
+
+Frame *Frame::place(void *block, size_t len, bool binary) {
+  Frame *result = new (block) Frame();
+  result->_data = (unsigned char *)(result + 1);
+  result->_len = len;
+  result->_refs = 1;
+  result->_deflated = nullptr;
+  result->_binary = binary;
+  result->_snapshot = kSnapshotNone;
+  result->_origin = 0;
+  unsigned char header[maxFrameHeader];
+  result->_header = frameHeader(header, len, false, binary);
+  memset((char *)result->_data, '\0', LWS_PRE - result->_header);
+  memcpy(result->wire(), header, result->_header);
+  return result;
+}
+
+Frame *Frame::deflated() {
+  Frame *result = _deflated.load();
+  if (result == nullptr) {
+    Frame *frame = deflateFrame(_data + LWS_PRE, _len, _binary);
+    if (frame != nullptr) {
+      if (_deflated.compare_exchange_strong(result, frame)) {
+        result = frame;
+      } else {
+        // another service thread got there first
+        frame->release();
+      }
+    }
+  }
+  return result;
+}
+
+unsigned char *Frame::wire() const {
+  return _data + LWS_PRE - _header;
+}
+
+void Frame::release() {
+  if (_refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+    Frame *deflated = _deflated.load();
+    if (deflated != nullptr) {
+      deflated->release();
+    }
+    this->~Frame();
+    free(this);
+  }
+}
 
 Message::Message() :
   _broadcast(nullptr),
-  _data(nullptr),
-  _len(0),
+  _frame(nullptr),
   _type(kZUnknown) {
 }
 
@@ -28,8 +162,7 @@ void Message::broadcast(const string &message) {
 
 void Message::create() {
   _broadcast = new string();
-  _data = nullptr;
-  _len = 0;
+  _frame = nullptr;
 }
 
 void Message::destroy() {
@@ -37,46 +170,44 @@ void Message::destroy() {
     delete _broadcast;
     _broadcast = nullptr;
   }
-  free(_data);
-  _data = nullptr;
-  _len = 0;
+  if (_frame != nullptr) {
+    _frame->release();
+    _frame = nullptr;
+  }
 }
 
-bool Message::build(const std::string data, const MessageType type) {
+bool Message::build(const std::string data, const MessageType type, bool binary) {
   _type = type;
-  return this->build((const unsigned char *)data.c_str(), data.length());
+  return this->build((const unsigned char *)data.c_str(), data.length(), binary);
 }
 
 bool Message::build(const Message &message) {
-  bool result;
-  if (_data == message._data && _len == message._len) {
-    result = true;
-  } else {
-    free(_data);
-    _type = message._type;
-    _len = message._len;
-    _data = (unsigned char *)malloc(LWS_PRE + _len);
-    result = (_data != NULL);
-    if (result) {
-      memcpy((char *)_data, message._data, LWS_PRE + _len);
+  // share the frame rather than copy it
+  if (_frame != message._frame) {
+    if (_frame != nullptr) {
+      _frame->release();
     }
+    _frame = message._frame != nullptr ? message._frame->retain() : nullptr;
   }
-  return result;
+  _type = message._type;
+  return _frame != nullptr;
 }
 
-bool Message::build(const unsigned char *data, size_t len) {
-  free(_data);
-
-  // over-allocate by LWS_PRE
-  _data = (unsigned char *)malloc(LWS_PRE + len);
-  _len = len;
+bool Message::build(const unsigned char *data, size_t len, bool binary) {
+  if (_frame != nullptr) {
+    _frame->release();
+  }
+  _frame = Frame::create(data, len, binary);
+  return _frame != nullptr;
+}
 
-  bool result = (_data != NULL);
-  if (result) {
-    memset((char *)_data, '\0', LWS_PRE);
-    memcpy((char *)_data + LWS_PRE, data, len);
+bool Message::build(Frame *frame, const MessageType type) {
+  if (_frame != nullptr) {
+    _frame->release();
   }
-  return result;
+  _frame = frame;
+  _type = type;
+  return _frame != nullptr;
 }
 
 bool Message::isBroadcast() const {
@@ -98,3 +229,72 @@ bool Message::isBroadcast() const {
   }
   return result;
 }
+
+bool MessageQueue::create(int depth, int highWater) {
+  _items = (Frame **)calloc(depth, sizeof(Frame *));
+  _depth = _items != nullptr ? depth : 0;
+  _head = 0;
+  _size = 0;
+  _dropped = 0;
+  _highWater = highWater;
+  _superseded = 0;
+  return _items != nullptr;
+}
+
+void MessageQueue::destroy() {
+  Frame *frame;
+  while ((frame = pop()) != nullptr) {
+    frame->release();
+  }
+  free(_items);
+  _items = nullptr;
+  _depth = 0;
+}
+
+Frame *MessageQueue::pop() {
+  Frame *result = nullptr;
+  if (_size) {
+    result = _items[_head];
+    _items[_head] = nullptr;
+    _head = (_head + 1) % _depth;
+    _size--;
+  }
+  return result;
+}
+
+bool MessageQueue::push(Frame *frame) {
+  bool result = true;
+  if (_size >= _highWater && frame->_snapshot != kSnapshotNone) {
+    // falling behind, the new state makes the waiting state redundant
+    supersede(frame->_snapshot);
+  }
+  if (_size == _depth) {
+    // full, the oldest frame makes way for the newest
+    _items[_head]->release();
+    _items[_head] = nullptr;
+    _head = (_head + 1) % _depth;
+    _size--;
+    _dropped++;
+    result = false;
+  }
+  _items[(_head + _size) % _depth] = frame->retain();
+  _size++;
+  return result;
+}
+
+void MessageQueue::supersede(Snapshot snapshot) {
+  int kept = 0;
+  for (int i = 0; i < _size; i++) {
+    int index = (_head + i) % _depth;
+    Frame *frame = _items[index];
+    _items[index] = nullptr;
+    if (frame->_snapshot != kSnapshotNone && frame->_snapshot <= snapshot) {
+      frame->release();
+      _superseded++;
+    } else {
+      _items[(_head + kept) % _depth] = frame;
+      kept++;
+    }
+  }
+  _size = kept;
+}
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <stdint.h>
 
@@ -23,26 +24,115 @@ enum MessageType {
   kRoom,
   kShuffle,
   kSkip,
+  kSync,
   kZUnknown
 };
 
+// how much of the game a frame restates, letting newer state replace it for a slow session
+enum Snapshot {
+  kSnapshotNone,
+  kSnapshotRoom,
+  kSnapshotFull
+};
+
+// the largest websocket frame header from the server
+static const int maxFrameHeader = 10;
+
+// immutable, reference counted websocket frame shared by every recipient
+struct Frame {
+  // allocates a frame holding a copy of data with LWS_PRE headroom
+  static Frame *create(const unsigned char *data, size_t len, bool binary = false);
+
+  // the bytes ahead of the payload in a frame's block: the Frame and LWS_PRE
+  static size_t headroom();
+
+  // makes a frame at the start of a malloc'd block of headroom() + len bytes that
+  // already holds the payload. the frame owns the block
+  static Frame *place(void *block, size_t len, bool binary = false);
+
+  // returns the frame compressed for permessage-deflate with its websocket header in
+  // place, ready for a raw write. created once and shared by every recipient
+  Frame *deflated();
+
+  // adds a reference to the frame
+  Frame *retain() { _refs.fetch_add(1, memory_order_relaxed); return this; }
+
+  // the websocket header and payload for sending the frame raw. the header is written
+  // once into the headroom, so every recipient sends the same bytes without a copy
+  unsigned char *wire() const;
+  int wireLen() const { return _header + _len; }
+
+  // drops a reference, freeing the frame with the last one
+  void release();
+
+  // LWS_PRE + _len bytes, never written once shared so only raw writes may send it
+  unsigned char *_data;
+  int _len;
+
+  // the length of the websocket header ending at the payload
+  int _header;
+  atomic<int> _refs;
+  atomic<Frame *> _deflated;
+
+  // sent as a binary rather than a text websocket frame
+  bool _binary;
+
+  // the game state restated by the frame, set by the builder before sharing
+  Snapshot _snapshot;
+
+  // metricNow() when the message causing the frame arrived, 0 when unknown. a cached
+  // frame sent again takes the time of the latest message
+  atomic<uint64_t> _origin;
+};
+
 struct Message {
   Message();
-  Message(const Message &message) { build(message); }
+  Message(const Message &message) : Message() { build(message); }
   Message& operator=(const Message &message) { build(message); return *this; }
   virtual ~Message();
 
   const string broadcast() const { return *_broadcast; }
   void broadcast(const string &message);
-  bool build(const string, const MessageType type);
+  bool build(const string, const MessageType type, bool binary = false);
   bool build(const Message &message);
-  bool build(const unsigned char *data, size_t len);
+  bool build(const unsigned char *data, size_t len, bool binary = false);
+  bool build(Frame *frame, const MessageType type);
   void create();
   void destroy();
   bool isBroadcast() const;
 
   string *_broadcast;
-  unsigned char *_data;
-  int _len;
+  Frame *_frame;
   MessageType _type;
 };
+
+// bounded FIFO of frames waiting for the session to become writeable
+struct MessageQueue {
+  // allocate room for depth pending frames. beyond highWater, new game state
+  // replaces the state frames still waiting. returns false when out of memory
+  bool create(int depth, int highWater);
+  void destroy();
+
+  // whether there are no pending frames
+  bool empty() const { return _size == 0; }
+
+  // the oldest pending frame, still owned by the queue. nullptr when empty
+  Frame *peek() const { return _size ? _items[_head] : nullptr; }
+
+  // takes the oldest pending frame, the caller releases it. nullptr when empty
+  Frame *pop();
+
+  // share the frame, evicting the oldest when full. returns false when a frame was lost
+  bool push(Frame *frame);
+
+  // drop the pending frames restating no more than the given snapshot
+  void supersede(Snapshot snapshot);
+
+  Frame **_items;
+  int _depth;
+  int _head;
+  int _size;
+  int _dropped;
+  int _highWater;
+  int _superseded;
+};
@@ -0,0 +1,240 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include "allocs.h"
+#include "controller.h"
+#include "histogram.h"
+#include "metrics.h"
+
+static const int messageTypes = kZUnknown + 1;
+
+// labels for the MessageType values
+static const char *typeNames[messageTypes] = {
+  "chat", "deal", "exchange", "init", "join", "nicname",
+  "pickup", "putdown", "room", "shuffle", "skip", "sync", "unknown"
+};
+
+// one thread's counters, zeroed on creation and never freed so totals
+// survive the thread
+struct ThreadMetrics {
+  atomic<uint64_t> _counters[kCounters];
+  atomic<uint64_t> _received[messageTypes];
+  atomic<uint64_t> _sent[messageTypes];
+  atomic<int64_t> _rooms[numRooms];
+  Histogram _handled[messageTypes];
+  Histogram _written;
+  ThreadMetrics *_next;
+};
+
+// every thread that has counted anything
+static atomic<ThreadMetrics *> allMetrics(nullptr);
+
+static thread_local ThreadMetrics *threadMetrics = nullptr;
+
+// returns the calling thread's counters, registering them on first use
+static ThreadMetrics *local() {
+  if (threadMetrics == nullptr) {
+    ThreadMetrics *metrics = new ThreadMetrics();
+    ThreadMetrics *head = allMetrics.load();
+    do {
+      metrics->_next = head;
+    } while (!allMetrics.compare_exchange_weak(head, metrics));
+    threadMetrics = metrics;
+  }
+  return threadMetrics;
+}
+
+// only the owning thread writes, so no read-modify-write is needed
+template<typename T>
+static void add(atomic<T> &value, T n) {
+  value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metric(Counter counter, uint64_t n) {
+  add(local()->_counters[counter], n);
+}
+
+uint64_t metricTotal(Counter counter) {
+  uint64_t result = 0;
+  for (ThreadMetrics *next = allMetrics.load(); next != nullptr; next = next->_next) {
+    result += next->_counters[counter].load(memory_order_relaxed);
+  }
+  return result;
+}
+
+void metricReceived(MessageType type) {
+  add(local()->_received[type], (uint64_t)1);
+}
+
+void metricSent(MessageType type) {
+  add(local()->_sent[type], (uint64_t)1);
+}
+
+void metricRoom(int room, int delta) {
+  if (room >= 0 && room < numRooms) {
+    add(local()->_rooms[room], (int64_t)delta);
+  }
+}
+
+const char *metricTypeName(MessageType type) {
+  return typeNames[type];
+}
+
+uint64_t metricNow() {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void metricHandled(MessageType type, uint64_t nanos) {
+  local()->_handled[type].record(nanos);
+}
+
+void metricWritten(uint64_t nanos) {
+  local()->_written.record(nanos);
+}
+
+// the reported percentiles
+static const double quantiles[] = {0.5, 0.99, 0.999};
+
+// adds up the latency histograms of every thread
+static void latencies(HistogramSnapshot *handled, HistogramSnapshot &written) {
+  for (ThreadMetrics *next = allMetrics.load(); next != nullptr; next = next->_next) {
+    for (int i = 0; i < messageTypes; i++) {
+      handled[i].add(next->_handled[i]);
+    }
+    written.add(next->_written);
+  }
+}
+
+// appends the histogram as a prometheus summary in seconds
+static void summary(string &out, const char *name, const char *labels, const HistogramSnapshot &histogram) {
+  char line[200];
+  for (double q : quantiles) {
+    snprintf(line, sizeof(line), "%s{%s%squantile=\"%g\"} %.9f\n", name, labels, *labels ? "," : "",
+             q, histogram.quantile(q) / 1e9);
+    out.append(line);
+  }
+  snprintf(line, sizeof(line), "%s_sum%s%s%s %.9f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+           histogram._sum / 1e9);
+  out.append(line);
+  snprintf(line, sizeof(line), "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+           (unsigned long long)histogram._count);
+  out.append(line);
+}
+
+// appends a line of percentiles in microseconds
+static void percentiles(string &out, const char *name, const HistogramSnapshot &histogram) {
+  char line[200];
+  snprintf(line, sizeof(line), "%-16s n=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", name,
+           (unsigned long long)histogram._count, histogram.quantile(0.5) / 1e3, histogram.quantile(0.99) / 1e3,
+           histogram.quantile(0.999) / 1e3, histogram._max / 1e3);
+  out.append(line);
+}
+
+string latencyReport() {
+  HistogramSnapshot *handled = new HistogramSnapshot[messageTypes];
+  HistogramSnapshot written;
+  latencies(handled, written);
+
+  string result;
+  string name;
+  for (int i = 0; i < messageTypes; i++) {
+    if (handled[i]._count != 0) {
+      name = string("handle ") + typeNames[i];
+      percentiles(result, name.c_str(), handled[i]);
+    }
+  }
+  if (written._count != 0) {
+    percentiles(result, "received-written", written);
+  }
+  delete [] handled;
+  return result;
+}
+
+static void append(string &out, const char *format, const char *label, unsigned long long value) {
+  char line[160];
+  snprintf(line, sizeof(line), format, label, value);
+  out.append(line);
+}
+
+static void describe(string &out, const char *name, const char *type, const char *help) {
+  out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+  out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+string metricsText() {
+  uint64_t counters[kCounters] = {};
+  uint64_t received[messageTypes] = {};
+  uint64_t sent[messageTypes] = {};
+  int64_t rooms[numRooms] = {};
+  for (ThreadMetrics *next = allMetrics.load(); next != nullptr; next = next->_next) {
+    for (int i = 0; i < kCounters; i++) {
+      counters[i] += next->_counters[i].load(memory_order_relaxed);
+    }
+    for (int i = 0; i < messageTypes; i++) {
+      received[i] += next->_received[i].load(memory_order_relaxed);
+      sent[i] += next->_sent[i].load(memory_order_relaxed);
+    }
+    for (int i = 0; i < numRooms; i++) {
+      rooms[i] += next->_rooms[i].load(memory_order_relaxed);
+    }
+  }
+
+  string result;
+  char room[8];
+  describe(result, "kibitzer_connections_total", "counter", "Websocket sessions opened.");
+  append(result, "kibitzer_connections_total%s %llu\n", "", counters[kConnections]);
+  describe(result, "kibitzer_connections", "gauge", "Websocket sessions open now.");
+  append(result, "kibitzer_connections%s %llu\n", "", counters[kConnections] - counters[kDisconnections]);
+  describe(result, "kibitzer_room_sessions", "gauge", "Sessions in each room.");
+  for (int i = 0; i < numRooms; i++) {
+    snprintf(room, sizeof(room), "%d", i + 1);
+    append(result, "kibitzer_room_sessions{room=\"%s\"} %llu\n", room, rooms[i] > 0 ? rooms[i] : 0);
+  }
+  describe(result, "kibitzer_messages_received_total", "counter", "Messages received by type.");
+  for (int i = 0; i < messageTypes; i++) {
+    append(result, "kibitzer_messages_received_total{type=\"%s\"} %llu\n", typeNames[i], received[i]);
+  }
+  describe(result, "kibitzer_messages_sent_total", "counter", "Messages queued for sessions by type.");
+  for (int i = 0; i < messageTypes; i++) {
+    append(result, "kibitzer_messages_sent_total{type=\"%s\"} %llu\n", typeNames[i], sent[i]);
+  }
+  describe(result, "kibitzer_received_bytes_total", "counter", "Websocket payload bytes received.");
+  append(result, "kibitzer_received_bytes_total%s %llu\n", "", counters[kBytesIn]);
+  describe(result, "kibitzer_sent_bytes_total", "counter", "Websocket bytes written, including frame headers.");
+  append(result, "kibitzer_sent_bytes_total%s %llu\n", "", counters[kBytesOut]);
+  describe(result, "kibitzer_sent_payload_bytes_total", "counter", "Websocket payload bytes sent, before compression.");
+  append(result, "kibitzer_sent_payload_bytes_total%s %llu\n", "", counters[kBytesPayload]);
+  describe(result, "kibitzer_frames_dropped_total", "counter", "Frames lost to a full session queue.");
+  append(result, "kibitzer_frames_dropped_total%s %llu\n", "", counters[kFramesDropped]);
+  describe(result, "kibitzer_frames_superseded_total", "counter", "Queued game state replaced by newer state.");
+  append(result, "kibitzer_frames_superseded_total%s %llu\n", "", counters[kFramesSuperseded]);
+  describe(result, "kibitzer_broadcast_recipients", "summary", "Sessions reached by each room broadcast.");
+  append(result, "kibitzer_broadcast_recipients_count%s %llu\n", "", counters[kBroadcasts]);
+  append(result, "kibitzer_broadcast_recipients_sum%s %llu\n", "", counters[kBroadcastRecipients]);
+  describe(result, "kibitzer_alloc_failures_total", "counter", "Frames and message buffers that could not be allocated.");
+  append(result, "kibitzer_alloc_failures_total%s %llu\n", "", counters[kAllocFailures]);
+  describe(result, "kibitzer_stalls_total", "counter", "Work reported by the watchdog for running too long.");
+  append(result, "kibitzer_stalls_total%s %llu\n", "", counters[kStalls]);
+
+  HistogramSnapshot *handled = new HistogramSnapshot[messageTypes];
+  HistogramSnapshot written;
+  latencies(handled, written);
+  string labels;
+  describe(result, "kibitzer_handle_seconds", "summary", "Time spent in Controller::handle by message type.");
+  for (int i = 0; i < messageTypes; i++) {
+    labels = string("type=\"") + typeNames[i] + "\"";
+    summary(result, "kibitzer_handle_seconds", labels.c_str(), handled[i]);
+  }
+  describe(result, "kibitzer_write_latency_seconds", "summary",
+           "Time from a message arriving until each resulting frame was written.");
+  summary(result, "kibitzer_write_latency_seconds", "", written);
+  delete [] handled;
+  result.append(allocText());
+  return result;
+}
@@ -0,0 +1,67 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <string>
+#include <stdint.h>
+#include "message.h"
+
+using namespace std;
+
+enum Counter {
+  kAllocFailures,
+  kBroadcastRecipients,
+  kBroadcasts,
+  kBytesIn,
+  kBytesOut,
+  kBytesPayload,
+  kConnections,
+  kDisconnections,
+  kFramesDropped,
+  kFramesSuperseded,
+  kStalls,
+  kCounters
+};
+
+//
+// counters are kept per thread and only written by their own thread, so updating
+// one is a plain load and store with no locked instruction or shared cache line.
+// the scrape adds up every thread's values
+//
+
+// adds n to the calling thread's counter
+void metric(Counter counter, uint64_t n = 1);
+
+// the counter added up across every thread
+uint64_t metricTotal(Counter counter);
+
+// counts a message received from a client
+void metricReceived(MessageType type);
+
+// counts a message queued for a client
+void metricSent(MessageType type);
+
+// moves delta sessions into the room
+void metricRoom(int room, int delta);
+
+// the monotonic clock used for latencies, in nanoseconds
+uint64_t metricNow();
+
+// records how long Controller::handle took with the message
+void metricHandled(MessageType type, uint64_t nanos);
+
+// records the time from a message arriving until a resulting frame was written
+void metricWritten(uint64_t nanos);
+
+// the latency percentiles, one line for each histogram holding anything
+string latencyReport();
+
+// the label for the message type
+const char *metricTypeName(MessageType type);
+
+// the totals across all threads in the prometheus text format
+string metricsText();
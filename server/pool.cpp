@@ -0,0 +1,60 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include <stdlib.h>
+#include "metrics.h"
+#include "pool.h"
+#include "utils.h"
+
+BufferPool::~BufferPool() {
+  for (int i = 0; i < classes; i++) {
+    for (unsigned char *buffer : _spare[i]) {
+      free(buffer);
+    }
+    _spare[i].clear();
+  }
+}
+
+unsigned char *BufferPool::acquire(size_t size, size_t &capacity) {
+  unsigned char *result = nullptr;
+  int index = sizeClass(size);
+  if (index != -1) {
+    capacity = minSize << index;
+    if (_spare[index].empty()) {
+      result = (unsigned char *)malloc(capacity);
+      if (result == nullptr) {
+        log("OOM: dropping message\n");
+        metric(kAllocFailures);
+      }
+    } else {
+      result = _spare[index].back();
+      _spare[index].pop_back();
+    }
+  }
+  if (result == nullptr) {
+    capacity = 0;
+  }
+  return result;
+}
+
+void BufferPool::release(unsigned char *buffer, size_t capacity) {
+  int index = sizeClass(capacity);
+  if (buffer != nullptr) {
+    if (index != -1 && (minSize << index) == capacity && _spare[index].size() < maxSpare) {
+      _spare[index].push_back(buffer);
+    } else {
+      free(buffer);
+    }
+  }
+}
+
+int BufferPool::sizeClass(size_t size) {
+  int result = 0;
+  while (result < classes && (minSize << result) < size) {
+    result++;
+  }
+  return result < classes ? result : -1;
+}
@@ -0,0 +1,39 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+using namespace std;
+
+// recycles buffers in power of two size classes, owned by a single thread
+struct BufferPool {
+  BufferPool() {}
+  virtual ~BufferPool();
+
+  // returns a buffer of at least size bytes and sets capacity to its real size.
+  // nullptr when size is beyond the largest class
+  unsigned char *acquire(size_t size, size_t &capacity);
+
+  // returns a buffer from acquire to its size class
+  void release(unsigned char *buffer, size_t capacity);
+
+  // the smallest and largest buffers
+  static const size_t minSize = 256;
+  static const size_t maxSize = 256 * 1024;
+
+private:
+  // returns the size class holding size bytes, or -1
+  static int sizeClass(size_t size);
+
+  // spare buffers kept for each class
+  static const size_t maxSpare = 16;
+  static const int classes = 11;
+
+  vector<unsigned char *> _spare[classes];
+};
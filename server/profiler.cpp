@@ -0,0 +1,157 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "profiler.h"
+
+// the deepest stack kept
+static const int maxFrames = 48;
+
+// the samples kept for one profile
+static const int maxSamples = 16384;
+
+// the profiler's own frames at the top of each stack: the handler and the signal return
+static const int skipFrames = 2;
+
+struct Sample {
+  void *_frames[maxFrames];
+  atomic<int> _depth;
+};
+
+static atomic<bool> profiling(false);
+static atomic<bool> sampling(false);
+static atomic<int> nextSample(0);
+static atomic<int> inHandler(0);
+static Sample *samples = nullptr;
+
+// runs on whichever thread was using the cpu
+static void profile_handler(int /*sig*/) {
+  inHandler++;
+  if (sampling.load()) {
+    int index = nextSample.fetch_add(1, memory_order_relaxed);
+    if (index < maxSamples) {
+      Sample &sample = samples[index];
+      sample._depth.store(backtrace(sample._frames, maxFrames), memory_order_release);
+    }
+  }
+  inHandler--;
+}
+
+// a readable name for the code address
+static string symbolize(void *address) {
+  string result;
+  Dl_info info;
+  if (dladdr(address, &info) && info.dli_sname != nullptr) {
+    int status;
+    char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    result = (status == 0 && demangled != nullptr) ? demangled : info.dli_sname;
+    free(demangled);
+  } else {
+    // static functions are not exported, fall back to the module and offset
+    char name[256];
+    const char *module = nullptr;
+    size_t offset = (size_t)address;
+    if (dladdr(address, &info) && info.dli_fname != nullptr) {
+      module = strrchr(info.dli_fname, '/');
+      module = module != nullptr ? module + 1 : info.dli_fname;
+      offset -= (size_t)info.dli_fbase;
+    }
+    snprintf(name, sizeof(name), "%s+0x%zx", module != nullptr ? module : "?", offset);
+    result = name;
+  }
+  // the folded format separates frames with ';' and the count with a space
+  for (char &c : result) {
+    if (c == ';' || c == ' ') {
+      c = '_';
+    }
+  }
+  return result;
+}
+
+bool profileStart(int hz) {
+  bool result = !profiling.exchange(true);
+  if (result) {
+    // the first backtrace loads libgcc, which is best not done in a signal handler
+    void *frames[1];
+    backtrace(frames, 1);
+    samples = new Sample[maxSamples]();
+    nextSample = 0;
+    sampling = true;
+
+    // left installed afterwards, a late SIGPROF would otherwise end the process
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+  }
+  return result;
+}
+
+string profileStop() {
+  string result;
+  if (profiling) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sampling = false;
+    while (inHandler.load() != 0) {
+      this_thread::yield();
+    }
+
+    // fold identical stacks, outermost frame first
+    map<void *, string> names;
+    map<string, int> stacks;
+    int count = min(nextSample.load(), maxSamples);
+    for (int i = 0; i < count; i++) {
+      const Sample &sample = samples[i];
+      int depth = sample._depth.load(memory_order_acquire);
+      string stack;
+      for (int frame = depth - 1; frame >= skipFrames; frame--) {
+        void *address = sample._frames[frame];
+        auto name = names.find(address);
+        if (name == names.end()) {
+          name = names.insert(make_pair(address, symbolize(address))).first;
+        }
+        if (!stack.empty()) {
+          stack.push_back(';');
+        }
+        stack.append(name->second);
+      }
+      if (!stack.empty()) {
+        stacks[stack]++;
+      }
+    }
+    for (auto &stack : stacks) {
+      result.append(stack.first).append(" ").append(to_string(stack.second)).append("\n");
+    }
+    if (nextSample.load() > maxSamples) {
+      result.append("[dropped] ").append(to_string(nextSample.load() - maxSamples)).append("\n");
+    }
+    delete [] samples;
+    samples = nullptr;
+    profiling = false;
+  }
+  return result;
+}
@@ -0,0 +1,24 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+//
+// a sampling profiler: ITIMER_PROF delivers SIGPROF for every 1/hz second of cpu used
+// by the process, and the thread taking the signal records its own backtrace into a
+// preallocated buffer. samples beyond the buffer are dropped. stacks are symbolized and
+// folded only when the profile stops, ready for flamegraph.pl or speedscope
+//
+
+// starts sampling, returns false when a profile is already running
+bool profileStart(int hz);
+
+// stops sampling and returns the folded stacks, "frame;frame;frame count" per line
+string profileStop();
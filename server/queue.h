@@ -0,0 +1,66 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <atomic>
+
+using namespace std;
+
+// lock-free intrusive queue with many producers and a single consumer.
+// T must be default constructible with an atomic<T *> _next member.
+template<typename T>
+struct MpscQueue {
+  MpscQueue() : _head(&_stub), _tail(&_stub) {
+    _stub._next.store(nullptr);
+  }
+
+  // whether the queue is empty, consumer only. a push in progress counts as not empty
+  bool empty() const {
+    return _tail == &_stub && _head.load() == &_stub;
+  }
+
+  // returns the oldest item or nullptr, consumer only
+  T *pop() {
+    T *result = nullptr;
+    T *tail = _tail;
+    T *next = tail->_next.load();
+    if (tail == &_stub && next != nullptr) {
+      // step over the stub
+      _tail = next;
+      tail = next;
+      next = next->_next.load();
+    }
+    if (tail == &_stub) {
+      // empty
+    } else if (next != nullptr) {
+      _tail = next;
+      result = tail;
+    } else if (tail == _head.load()) {
+      // the last item, put the stub back behind it
+      push(&_stub);
+      next = tail->_next.load();
+      if (next != nullptr) {
+        _tail = next;
+        result = tail;
+      }
+    }
+    // otherwise a producer is part way through a push
+    return result;
+  }
+
+  // appends the item, any thread
+  void push(T *item) {
+    item->_next.store(nullptr);
+    T *prev = _head.exchange(item);
+    prev->_next.store(item);
+  }
+
+private:
+  atomic<T *> _head;
+  T *_tail;
+  T _stub;
+};
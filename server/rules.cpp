@@ -6,189 +6,262 @@
 
 #include "rules.h"
 
+// the number of faces, two to ace
+static const int faces = 13;
+
+// each card's rank for a game, and the cards ranking above it
+struct RankTable {
+  int _rank[deckSize];
+  CardSet _higher[deckSize];
+};
+
+// builds the table for a game where the given face ranks lowest, 0 for two
+static constexpr RankTable rankTable(int lowest) {
+  RankTable result {};
+  for (int card = 0; card < deckSize; card++) {
+    // cards run in faces of four suits
+    result._rank[card] = ((card >> 2) - lowest + faces) % faces;
+  }
+  for (int card = 0; card < deckSize; card++) {
+    for (int other = 0; other < deckSize; other++) {
+      if (result._rank[other] > result._rank[card]) {
+        result._higher[card] |= (CardSet)1 << other;
+      }
+    }
+  }
+  return result;
+}
+
+// two low, ace high
+static constexpr RankTable ranks2A = rankTable(0);
+
+// three low, two high
+static constexpr RankTable ranks32 = rankTable(1);
+
+static_assert(ranks2A._rank[k2c] == 0 && ranks2A._rank[kad] == 12, "rank2A");
+static_assert(ranks32._rank[k3s] == 0 && ranks32._rank[kah] == 11 && ranks32._rank[k2d] == 12, "rank32");
+static_assert(ranks32._higher[kas] == faceSet(k2c), "only twos beat aces");
+
 static int rank2A(Card card) {
-  switch (card) {
-  case k2c: return 0;  case k2s: return 0;  case k2h: return 0;  case k2d: return 0;
-  case k3c: return 1;  case k3s: return 1;  case k3h: return 1;  case k3d: return 1;
-  case k4c: return 2;  case k4s: return 2;  case k4h: return 2;  case k4d: return 2;
-  case k5c: return 3;  case k5s: return 3;  case k5h: return 3;  case k5d: return 3;
-  case k6c: return 4;  case k6s: return 4;  case k6h: return 4;  case k6d: return 4;
-  case k7c: return 5;  case k7s: return 5;  case k7h: return 5;  case k7d: return 5;
-  case k8c: return 6;  case k8s: return 6;  case k8h: return 6;  case k8d: return 6;
-  case k9c: return 7;  case k9s: return 7;  case k9h: return 7;  case k9d: return 7;
-  case kXc: return 8;  case kXs: return 8;  case kXh: return 8;  case kXd: return 8;
-  case kjc: return 9;  case kjs: return 9;  case kjh: return 9;  case kjd: return 9;
-  case kqc: return 10; case kqs: return 10; case kqh: return 10; case kqd: return 10;
-  case kkc: return 11; case kks: return 11; case kkh: return 11; case kkd: return 11;
-  case kac: return 12; case kas: return 12; case kah: return 12; case kad: return 12;
-  }
-  return -1;
+  return ranks2A._rank[card];
 }
 
 static int rank32(Card card) {
-  switch (card) {
-  case k3c: return 0;  case k3s: return 0;  case k3h: return 0;  case k3d: return 0;
-  case k4c: return 1;  case k4s: return 1;  case k4h: return 1;  case k4d: return 1;
-  case k5c: return 2;  case k5s: return 2;  case k5h: return 2;  case k5d: return 2;
-  case k6c: return 3;  case k6s: return 3;  case k6h: return 3;  case k6d: return 3;
-  case k7c: return 4;  case k7s: return 4;  case k7h: return 4;  case k7d: return 4;
-  case k8c: return 5;  case k8s: return 5;  case k8h: return 5;  case k8d: return 5;
-  case k9c: return 6;  case k9s: return 6;  case k9h: return 6;  case k9d: return 6;
-  case kXc: return 7;  case kXs: return 7;  case kXh: return 7;  case kXd: return 7;
-  case kjc: return 8;  case kjs: return 8;  case kjh: return 8;  case kjd: return 8;
-  case kqc: return 9;  case kqs: return 9;  case kqh: return 9;  case kqd: return 9;
-  case kkc: return 10; case kks: return 10; case kkh: return 10; case kkd: return 10;
-  case kac: return 11; case kas: return 11; case kah: return 11; case kad: return 11;
-  case k2c: return 12; case k2s: return 12; case k2h: return 12; case k2d: return 12;
-  }
-  return -1;
+  return ranks32._rank[card];
+}
+
+bool Plays::has(CardSet play) const {
+  bool result = false;
+  for (int i = 0; i < _count; i++) {
+    if (_plays[i] == play) {
+      result = true;
+      break;
+    }
+  }
+  return result;
+}
+
+CardSet Plays::playable() const {
+  CardSet result = 0;
+  for (int i = 0; i < _count; i++) {
+    result |= _plays[i];
+  }
+  return result;
 }
 
-struct RulesFree : public Rules {
-  bool canPlay(const Deck &deck, const Hand &hand) const {
+// the rules for a game as static functions, bound to Rules by GameRules
+struct RulesFree {
+  static CardRank rank() {
+    return rank2A;
+  }
+
+  static bool canPlay(const Deck &deck, const Hand &hand) {
     bool result;
     if (hand.size() == 0) {
       result = false;
     } else if (!deck.discardSize()) {
       result = true;
     } else {
-      result = hand.hasHigher(deck.lastPlay(), 1, rank2A);
+      result = hand.hasHigher(ranks2A._higher[deck.lastPlay()], 1);
     }
     return result;
   }
 
-  bool canRevoke() const {
+  static bool canRevoke() {
     return true;
   }
 
-  bool clearDiscard(const Hand &) const {
+  static bool clearDiscard(const Hand &) {
     return false;
   }
 
-  CardRank getRank() const {
-    return rank2A;
-  }
-
-  int handSize(int) const {
+  static int handSize(int) {
     return 7;
   }
 
-  bool faceDown() const {
+  static bool faceDown() {
     return false;
   }
 
-  bool isValidPlay(const Deck &, const Hand &) const {
+  static bool isValidPlay(const Deck &, const Hand &) {
     return true;
   }
 
-  bool isWinningPlay(const Deck &, const Hand &) const {
+  static bool isWinningPlay(const Deck &, const Hand &) {
     return false;
   }
 
-  const char *name() const {
+  static bool legalPlays(const Deck &, const Hand &, Plays &) {
+    return false;
+  }
+
+  static const char *name() {
     return "Rules Free";
   }
 
-  const char *url() const {
+  static const char *url() {
     return "https://en.wikipedia.org/wiki/Card_game";
   }
 
-  bool noPlayTakesDiscard() const {
+  static bool noPlayTakesDiscard() {
     return false;
   }
 
-  bool setNextTurn(const Hand &) const {
+  static bool setNextTurn(const Hand &) {
     return true;
   }
-} rulesFree;
+};
 
 // https://www.pagat.com/climbing/president.html
-struct Warlords : public Rules {
-  bool canPlay(const Deck &deck, const Hand &hand) const {
+struct Warlords {
+  static CardRank rank() {
+    return rank32;
+  }
+
+  static bool canPlay(const Deck &deck, const Hand &hand) {
     bool result;
     if (hand.size() == 0) {
       result = false;
-    } else if (hand.hasEqual(k2c, rank32)) {
+    } else if (hand.hasEqual(k2c)) {
       // can play 2 anytime
       result = true;
     } else if (!deck.discardSize()) {
       // discard pile is empty
       result = true;
-    } else if (rank32(deck.lastPlay()) == rank32(k2c)) {
+    } else if (faceSet(deck.lastPlay()) == faceSet(k2c)) {
       // restart the sequence
       result = true;
     } else {
       // can they play an equal or higher value card
-      result = hand.hasHigher(deck.lastPlay(), deck.lastSize(), rank32);
+      result = hand.hasHigher(ranks32._higher[deck.lastPlay()], deck.lastSize());
     }
     return result;
   }
 
-  bool clearDiscard(const Hand &hand) const {
+  static bool clearDiscard(const Hand &hand) {
     // playing 3s and 10s (or 4 the same) clears the deck
-    return (hand.hasEqual(k3c, rank32) || hand.hasEqual(kXc, rank32) || hand.size() == 4);
+    return (hand.hasEqual(k3c) || hand.hasEqual(kXc) || hand.size() == 4);
   }
 
-  bool canRevoke() const {
+  static bool canRevoke() {
     return false;
   }
 
-  CardRank getRank() const {
-    return rank32;
-  }
-
-  int handSize(int players) const {
+  static int handSize(int players) {
     return 52 / players;
   }
 
-  bool faceDown() const {
+  static bool faceDown() {
     return false;
   }
 
-  bool isValidPlay(const Deck &deck, const Hand &hand) const {
+  static bool isValidPlay(const Deck &deck, const Hand &hand) {
     bool result;
     if (hand.size() == 0) {
       // played hand was empty
       result = false;
-    } else if (!hand.isEqual(hand.peek(), rank32)) {
+    } else if (!hand.isEqual(hand.peek())) {
       // must be 1 or more cards with the same value
       result = false;
-    } else if (hand.hasEqual(k2c, rank32)) {
+    } else if (hand.hasEqual(k2c)) {
       // can play 2 anytime
       result = true;
     } else if (!deck.discardSize()) {
       // discard pile is empty
       result = true;
-    } else if (rank32(deck.lastPlay()) == rank32(k2c)) {
+    } else if (faceSet(deck.lastPlay()) == faceSet(k2c)) {
       // restart the sequence
       result = true;
     } else {
       // can they play an higher value card with a hand the same size of the last
-      result = hand.hasHigher(deck.lastPlay(), 1, rank32) && hand.size() == deck.lastSize();
+      result = hand.hasHigher(ranks32._higher[deck.lastPlay()], 1) && hand.size() == deck.lastSize();
     }
     return result;
   }
 
-  bool isWinningPlay(const Deck &, const Hand &hand) const {
+  static bool isWinningPlay(const Deck &, const Hand &hand) {
     return hand.size() == 0;
   }
 
-  const char *name() const {
+  static bool legalPlays(const Deck &deck, const Hand &hand, Plays &plays) {
+    CardSet cards = hand.toMask();
+    // any number of one face leads, or follows a 2
+    bool lead = !deck.discardSize() || faceSet(deck.lastPlay()) == faceSet(k2c);
+    CardSet higher = lead ? 0 : ranks32._higher[deck.lastPlay()];
+    while (cards != 0) {
+      CardSet suits = faceSet(lowestCard(cards));
+      CardSet face = cards & suits;
+      bool any = lead || suits == faceSet(k2c);
+      if (any || (face & higher) != 0) {
+        // each combination of the suits held, matching the last play's size unless free
+        for (CardSet play = face; play != 0; play = (play - 1) & face) {
+          if (any || cardCount(play) == deck.lastSize()) {
+            plays.add(play);
+          }
+        }
+      }
+      cards &= ~suits;
+    }
+    return true;
+  }
+
+  static const char *name() {
     return "Warlords and Scumbags";
   }
 
-  const char *url() const {
+  static const char *url() {
     return "https://en.wikipedia.org/wiki/President_(card_game)";
   }
 
-  bool noPlayTakesDiscard() const {
+  static bool noPlayTakesDiscard() {
     return true;
   }
 
-  bool setNextTurn(const Hand &hand) const {
+  static bool setNextTurn(const Hand &hand) {
     return !clearDiscard(hand);
   }
-} warLords;
+};
+
+// the room's one virtual call into a game, everything beneath it is resolved at compile time
+template<class Policy>
+struct GameRules final : public Rules {
+  bool canPlay(const Deck &deck, const Hand &hand) const override { return Policy::canPlay(deck, hand); }
+  bool canRevoke() const override { return Policy::canRevoke(); }
+  bool clearDiscard(const Hand &hand) const override { return Policy::clearDiscard(hand); }
+  bool faceDown() const override { return Policy::faceDown(); }
+  CardRank getRank() const override { return Policy::rank(); }
+  int handSize(int players) const override { return Policy::handSize(players); }
+  bool isValidPlay(const Deck &deck, const Hand &hand) const override { return Policy::isValidPlay(deck, hand); }
+  bool isWinningPlay(const Deck &deck, const Hand &hand) const override { return Policy::isWinningPlay(deck, hand); }
+  bool legalPlays(const Deck &deck, const Hand &hand, Plays &plays) const override { return Policy::legalPlays(deck, hand, plays); }
+  const char *name() const override { return Policy::name(); }
+  const char *url() const override { return Policy::url(); }
+  bool noPlayTakesDiscard() const override { return Policy::noPlayTakesDiscard(); }
+  bool setNextTurn(const Hand &hand) const override { return Policy::setNextTurn(hand); }
+};
+
+static GameRules<RulesFree> rulesFree;
+static GameRules<Warlords> warLords;
 
 Rules *getRules(Game game) {
   Rules *result;
@@ -14,6 +14,30 @@ enum Game {
   kWarlords
 };
 
+// the legal plays for a hand, each the set of cards put down together
+struct Plays {
+  Plays() : _count(0) {}
+
+  // appends the play
+  void add(CardSet play) {
+    if (_count < maxPlays) {
+      _plays[_count++] = play;
+    }
+  }
+
+  // whether the cards make one of the plays
+  bool has(CardSet play) const;
+
+  // the cards found in any play
+  CardSet playable() const;
+
+  // every combination of the suits of each face
+  static const int maxPlays = 13 * 15;
+
+  CardSet _plays[maxPlays];
+  int _count;
+};
+
 struct Rules {
   Rules() {}
   virtual ~Rules() {}
@@ -42,6 +66,9 @@ struct Rules {
   // whether the hand was a winning play
   virtual bool isWinningPlay(const Deck &deck, const Hand &hand) const = 0;
 
+  // fills in every valid play from the hand, returns false when any cards may be played
+  virtual bool legalPlays(const Deck &deck, const Hand &hand, Plays &plays) const = 0;
+
   // the card game name
   virtual const char *name() const = 0;
 
@@ -55,4 +82,5 @@ struct Rules {
   virtual bool setNextTurn(const Hand &hand) const = 0;
 };
 
+// returns the rules for the game, each built from a policy of static functions
 Rules *getRules(Game game);
@@ -0,0 +1,217 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include <libwebsockets.h>
+#include "allocs.h"
+#include "metrics.h"
+#include "shard.h"
+#include "trace.h"
+#include "watchdog.h"
+
+// the number of commands handled before waking the service threads
+static const int batchSize = 64;
+
+Shard::Shard() :
+  _context(nullptr),
+  _shards(nullptr),
+  _outboxes(nullptr),
+  _sleeping(false),
+  _stopping(false),
+  _delivered(false) {
+}
+
+void Shard::post(Command *command) {
+  _ingress.push(command);
+  if (_sleeping.exchange(false)) {
+    lock_guard<mutex> lock(_lock);
+    _wake.notify_one();
+  }
+}
+
+void Shard::start(lws_context *context, Shard *shards, Outbox *outboxes) {
+  _context = context;
+  _shards = shards;
+  _outboxes = outboxes;
+  _thread = thread(&Shard::run, this);
+}
+
+void Shard::stop() {
+  _stopping = true;
+  {
+    lock_guard<mutex> lock(_lock);
+    _wake.notify_one();
+  }
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+}
+
+Shard::~Shard() {
+  // discard anything still queued
+  Command *command;
+  while ((command = _ingress.pop()) != nullptr) {
+    delete command->_player;
+    delete command;
+  }
+  for (auto &pending : _pending) {
+    for (Command *next : pending.second) {
+      delete next;
+    }
+  }
+  _pending.clear();
+}
+
+void Shard::attach(Command *command) {
+  int sessionId = command->_sessionId;
+  if (command->_player != nullptr) {
+    _controller.attach(*command->_player);
+    _tsi[sessionId] = command->_tsi;
+    delete command->_player;
+    command->_player = nullptr;
+    receive(sessionId, command->_data, command->_received);
+  }
+
+  // replay anything the session sent during the hand over
+  auto pending = _pending.find(sessionId);
+  if (pending != _pending.end()) {
+    vector<Command *> commands;
+    commands.swap(pending->second);
+    _pending.erase(pending);
+    for (Command *next : commands) {
+      dispatch(next);
+    }
+  }
+}
+
+void Shard::close(int sessionId) {
+  // the room being left
+  const vector<int> members = _controller.members(sessionId);
+  const Message message = _controller.destroySession(sessionId);
+  _tsi.erase(sessionId);
+
+  // tell the other players in the room this one has left
+  metric(kBroadcasts);
+  metric(kBroadcastRecipients, members.size());
+  for (int id : members) {
+    deliver(id, message);
+  }
+}
+
+void Shard::deliver(int sessionId, const Message &message, uint64_t received) {
+  auto tsi = _tsi.find(sessionId);
+  if (message._frame != nullptr && tsi != _tsi.end()) {
+    if (received != 0) {
+      message._frame->_origin.store(received, memory_order_relaxed);
+    }
+    Delivery *delivery = new Delivery();
+    delivery->_frame = message._frame->retain();
+    delivery->_sessionId = sessionId;
+    _outboxes[tsi->second].push(delivery);
+    _delivered = true;
+    metricSent(message._type);
+  }
+}
+
+void Shard::detach(Command *command) {
+  int sessionId = command->_sessionId;
+  auto tsi = _tsi.find(sessionId);
+
+  Command *attach = new Command(kAttach, sessionId);
+  attach->_data.swap(command->_data);
+  attach->_received = command->_received;
+  if (tsi != _tsi.end()) {
+    attach->_player = new Player(sessionId);
+    attach->_tsi = tsi->second;
+    _controller.detach(sessionId, *attach->_player);
+    _tsi.erase(tsi);
+  }
+  _shards[command->_shard].post(attach);
+}
+
+void Shard::dispatch(Command *command) {
+  WatchBusy busy;
+  watchWork(kZUnknown, -1, command->_sessionId);
+  auto pending = _pending.find(command->_sessionId);
+  if (pending != _pending.end() && command->_type != kAttach) {
+    // the session is still arriving from another shard
+    pending->second.push_back(command);
+  } else {
+    switch (command->_type) {
+    case kAttach:
+      attach(command);
+      break;
+    case kClose:
+      close(command->_sessionId);
+      break;
+    case kConnect:
+      _controller.createSession(command->_sessionId, command->_binary);
+      _tsi[command->_sessionId] = command->_tsi;
+      break;
+    case kDetach:
+      detach(command);
+      break;
+    case kExpect:
+      _pending[command->_sessionId];
+      break;
+    case kReceive:
+      receive(command->_sessionId, command->_data, command->_received);
+      break;
+    }
+    delete command;
+  }
+}
+
+void Shard::receive(int sessionId, const string &data, uint64_t received) {
+  Message response;
+  if (_controller.handle(data, response, sessionId)) {
+    AllocScope allocs(response._type, kPhaseFanout);
+    if (response.isBroadcast()) {
+      // let everybody in the room know we want to write something on them as soon as they are ready
+      const vector<int> &members = _controller.members(sessionId);
+      metric(kBroadcasts);
+      metric(kBroadcastRecipients, members.size());
+      for (int id : members) {
+        if (id == sessionId) {
+          deliver(id, response, received);
+        } else {
+          deliver(id, _controller.redact(id, response), received);
+        }
+      }
+    } else {
+      deliver(sessionId, response, received);
+    }
+  }
+}
+
+void Shard::run() {
+  traceThread("shard");
+  watchThread("shard");
+  while (!_stopping) {
+    // handle a batch of commands before waking the service threads
+    int count = 0;
+    Command *command;
+    while (count < batchSize && (command = _ingress.pop()) != nullptr) {
+      dispatch(command);
+      count++;
+    }
+    if (_delivered) {
+      _delivered = false;
+      lws_cancel_service(_context);
+    }
+    if (count == 0) {
+      wait();
+    }
+  }
+}
+
+void Shard::wait() {
+  unique_lock<mutex> lock(_lock);
+  _sleeping = true;
+  if (_ingress.empty() && !_stopping) {
+    _wake.wait(lock, [this] { return !_sleeping || _stopping; });
+  }
+  _sleeping = false;
+}
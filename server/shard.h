@@ -0,0 +1,128 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "controller.h"
+#include "message.h"
+#include "queue.h"
+
+struct lws_context;
+
+// a frame waiting to be queued on a session by its service thread
+struct Delivery {
+  Delivery() : _next(nullptr), _frame(nullptr), _sessionId(-1) {}
+  atomic<Delivery *> _next;
+  Frame *_frame;
+  int _sessionId;
+};
+
+// the frames for the sessions of one service thread
+typedef MpscQueue<Delivery> Outbox;
+
+enum CommandType {
+  kAttach,
+  kClose,
+  kConnect,
+  kDetach,
+  kExpect,
+  kReceive
+};
+
+// a request for a shard's game logic thread
+struct Command {
+  Command() : _next(nullptr), _player(nullptr), _type(kReceive), _sessionId(-1), _tsi(0), _shard(0), _binary(false), _received(0) {}
+  Command(CommandType type, int sessionId) : Command() { _type = type; _sessionId = sessionId; }
+  atomic<Command *> _next;
+
+  // the received message
+  string _data;
+
+  // kAttach: the player handed over by another shard
+  Player *_player;
+
+  CommandType _type;
+  int _sessionId;
+
+  // kConnect, kAttach: the session's service thread
+  int _tsi;
+
+  // kDetach: the shard taking over the session
+  int _shard;
+
+  // kConnect: the session uses the compact binary protocol
+  bool _binary;
+
+  // kReceive, kDetach, kAttach: metricNow() when the message arrived
+  uint64_t _received;
+};
+
+// a partition of the rooms, owned by a single game logic thread
+struct Shard {
+  Shard();
+  virtual ~Shard();
+
+  // queue the command for the logic thread, callable from any thread
+  void post(Command *command);
+
+  // start the logic thread
+  void start(lws_context *context, Shard *shards, Outbox *outboxes);
+
+  // stop and join the logic thread
+  void stop();
+
+private:
+  // hand the player over to its new room
+  void attach(Command *command);
+
+  // queue a frame for the session and remember to wake its service thread. received
+  // is when the message causing it arrived, or 0
+  void deliver(int sessionId, const Message &message, uint64_t received = 0);
+
+  // handle the session leaving
+  void close(int sessionId);
+
+  // remove the player ready for another shard
+  void detach(Command *command);
+
+  // process the command, taking ownership
+  void dispatch(Command *command);
+
+  // handle a message from the session
+  void receive(int sessionId, const string &data, uint64_t received);
+
+  // the logic thread
+  void run();
+
+  // block until a command is posted
+  void wait();
+
+  // commands from the service threads and other shards
+  MpscQueue<Command> _ingress;
+
+  // the rooms and players owned by this shard
+  Controller _controller;
+
+  // live session ids to service thread index
+  unordered_map<int, int> _tsi;
+
+  // commands held back until a session handed over from another shard arrives
+  unordered_map<int, vector<Command *>> _pending;
+
+  lws_context *_context;
+  Shard *_shards;
+  Outbox *_outboxes;
+  thread _thread;
+  mutex _lock;
+  condition_variable _wake;
+  atomic<bool> _sleeping;
+  atomic<bool> _stopping;
+  bool _delivered;
+};
@@ -0,0 +1,137 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+#include "trace.h"
+
+atomic<bool> traceOn(false);
+
+// the ring size, fixed by traceStart
+static int ringSize = 0;
+
+struct TraceEvent {
+  atomic<const char *> _name;
+  atomic<uint64_t> _start;
+  atomic<uint64_t> _duration;
+  atomic<int> _arg;
+};
+
+// one thread's spans. the writer claims a slot, fills it, then publishes it. a reader
+// copies the published slots and then discards any a writer may have claimed meanwhile
+struct TraceRing {
+  TraceEvent *_events;
+  atomic<uint64_t> _claimed;
+  atomic<uint64_t> _published;
+  uint64_t _flushed; /* guarded by flushLock */
+  int _tid;
+  char _name[24];
+  atomic<bool> _named;
+  TraceRing *_next;
+};
+
+static atomic<TraceRing *> allRings(nullptr);
+static atomic<int> nextTid(1);
+static thread_local TraceRing *threadRing = nullptr;
+static mutex flushLock;
+
+// returns the calling thread's ring, registering it on first use
+static TraceRing *local() {
+  if (threadRing == nullptr) {
+    TraceRing *ring = new TraceRing();
+    ring->_events = new TraceEvent[ringSize]();
+    ring->_tid = nextTid++;
+    TraceRing *head = allRings.load();
+    do {
+      ring->_next = head;
+    } while (!allRings.compare_exchange_weak(head, ring));
+    threadRing = ring;
+  }
+  return threadRing;
+}
+
+void traceStart(int events) {
+  if (!traceOn) {
+    ringSize = events;
+    traceOn = true;
+  }
+}
+
+void traceThread(const char *name) {
+  if (traceOn) {
+    TraceRing *ring = local();
+    snprintf(ring->_name, sizeof(ring->_name), "%s %d", name, ring->_tid);
+    ring->_named.store(true, memory_order_release);
+  }
+}
+
+void traceRecord(const char *name, uint64_t start, uint64_t duration, int arg) {
+  TraceRing *ring = local();
+  uint64_t seq = ring->_claimed.load(memory_order_relaxed);
+  ring->_claimed.store(seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  TraceEvent &event = ring->_events[seq % ringSize];
+  event._name.store(name, memory_order_relaxed);
+  event._start.store(start, memory_order_relaxed);
+  event._duration.store(duration, memory_order_relaxed);
+  event._arg.store(arg, memory_order_relaxed);
+  ring->_published.store(seq + 1, memory_order_release);
+}
+
+// appends a complete event, times in microseconds
+static void appendEvent(string &out, const char *name, uint64_t start, uint64_t duration, int arg, int tid) {
+  char line[200];
+  int len = snprintf(line, sizeof(line),
+                     "{\"name\":\"%s\",\"cat\":\"kibitzer\",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,"
+                     "\"pid\":1,\"tid\":%d",
+                     name, (unsigned long long)(start / 1000), (unsigned)(start % 1000),
+                     (unsigned long long)(duration / 1000), (unsigned)(duration % 1000), tid);
+  out.append(line, len);
+  if (arg != -1) {
+    len = snprintf(line, sizeof(line), ",\"args\":{\"id\":%d}", arg);
+    out.append(line, len);
+  }
+  out.append("},\n");
+}
+
+string traceJson() {
+  string result = "{\"traceEvents\":[\n";
+  if (traceOn) {
+    lock_guard<mutex> lock(flushLock);
+    for (TraceRing *ring = allRings.load(); ring != nullptr; ring = ring->_next) {
+      if (ring->_named.load(memory_order_acquire)) {
+        result.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":")
+          .append(to_string(ring->_tid)).append(",\"args\":{\"name\":\"").append(ring->_name).append("\"}},\n");
+      }
+      uint64_t end = ring->_published.load(memory_order_acquire);
+      uint64_t begin = max(ring->_flushed, end > (uint64_t)ringSize ? end - ringSize : 0);
+      struct Copied { const char *_name; uint64_t _start; uint64_t _duration; int _arg; };
+      vector<Copied> spans;
+      spans.reserve(end - begin);
+      for (uint64_t seq = begin; seq < end; seq++) {
+        const TraceEvent &event = ring->_events[seq % ringSize];
+        spans.push_back({event._name.load(memory_order_relaxed), event._start.load(memory_order_relaxed),
+                         event._duration.load(memory_order_relaxed), event._arg.load(memory_order_relaxed)});
+      }
+      // anything claimed since may have overwritten the oldest copies
+      atomic_thread_fence(memory_order_acquire);
+      uint64_t claimed = ring->_claimed.load(memory_order_relaxed);
+      uint64_t valid = claimed > (uint64_t)ringSize ? claimed - ringSize : 0;
+      for (uint64_t seq = max(begin, valid); seq < end; seq++) {
+        const Copied &span = spans[seq - begin];
+        appendEvent(result, span._name, span._start, span._duration, span._arg, ring->_tid);
+      }
+      ring->_flushed = end;
+    }
+  }
+  if (result.back() == '\n' && result[result.length() - 2] == ',') {
+    result.erase(result.length() - 2, 1);
+  }
+  result.append("]}\n");
+  return result;
+}
@@ -0,0 +1,55 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include "metrics.h"
+
+using namespace std;
+
+//
+// spans recorded into a ring buffer per thread, which only that thread writes. once
+// full the oldest spans are overwritten. traceJson collects the spans recorded since
+// the last call in the chrome trace event format, for chrome://tracing or perfetto.
+// tracing is off until traceStart, and a span then costs a branch
+//
+
+// set by traceStart
+extern atomic<bool> traceOn;
+
+// starts recording, keeping up to events spans for each thread
+void traceStart(int events);
+
+// names the calling thread in the trace
+void traceThread(const char *name);
+
+// records a finished span. name must outlive the trace, a literal
+void traceRecord(const char *name, uint64_t start, uint64_t duration, int arg);
+
+// the spans since the last call as chrome trace event JSON
+string traceJson();
+
+// records the time until the end of the enclosing block
+struct TraceSpan {
+  TraceSpan(const char *name, int arg = -1) :
+    _name(name),
+    _arg(arg),
+    _start(traceOn.load(memory_order_acquire) ? metricNow() : 0) {
+  }
+
+  ~TraceSpan() {
+    if (_start != 0) {
+      traceRecord(_name, _start, metricNow() - _start, _arg);
+    }
+  }
+
+  const char *_name;
+  int _arg;
+  uint64_t _start;
+};
@@ -0,0 +1,139 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "utils.h"
+#include "watchdog.h"
+
+// sent to a stalled thread to have it write its backtrace
+static const int backtraceSignal = SIGUSR2;
+
+// the most frames written for a stalled thread
+static const int maxFrames = 32;
+
+// a watched thread, written by that thread and read by the watchdog
+struct Watched {
+  atomic<uint64_t> _busy; /* metricNow() when the work began, 0 when idle */
+  atomic<int> _type;
+  atomic<int> _room;
+  atomic<int> _session;
+  uint64_t _reported; /* the _busy already reported, watchdog only */
+  pthread_t _thread;
+  char _name[24];
+  Watched *_next;
+};
+
+static atomic<Watched *> allWatched(nullptr);
+static atomic<int> watchedCount(0);
+static thread_local Watched *threadWatched = nullptr;
+static thread_local int busyDepth = 0;
+
+static thread watchdog;
+static mutex watchLock;
+static condition_variable watchWake;
+static bool watchStopping = false;
+
+void watchThread(const char *name) {
+  if (threadWatched == nullptr) {
+    Watched *watched = new Watched();
+    watched->_thread = pthread_self();
+    watched->_type = kZUnknown;
+    watched->_room = -1;
+    watched->_session = -1;
+    snprintf(watched->_name, sizeof(watched->_name), "%s %d", name, watchedCount++);
+    Watched *head = allWatched.load();
+    do {
+      watched->_next = head;
+    } while (!allWatched.compare_exchange_weak(head, watched));
+    threadWatched = watched;
+  }
+}
+
+void watchWork(MessageType type, int room, int sessionId) {
+  Watched *watched = threadWatched;
+  if (watched != nullptr) {
+    watched->_type.store(type, memory_order_relaxed);
+    watched->_room.store(room, memory_order_relaxed);
+    watched->_session.store(sessionId, memory_order_relaxed);
+  }
+}
+
+WatchBusy::WatchBusy() {
+  Watched *watched = threadWatched;
+  if (watched != nullptr && busyDepth++ == 0) {
+    watched->_busy.store(metricNow(), memory_order_relaxed);
+  }
+}
+
+WatchBusy::~WatchBusy() {
+  Watched *watched = threadWatched;
+  if (watched != nullptr && --busyDepth == 0) {
+    watched->_busy.store(0, memory_order_relaxed);
+    watchWork(kZUnknown, -1, -1);
+  }
+}
+
+// runs on the stalled thread
+static void backtrace_handler(int /*sig*/) {
+  void *frames[maxFrames];
+  int n = backtrace(frames, maxFrames);
+  backtrace_symbols_fd(frames, n, STDERR_FILENO);
+}
+
+static void report(Watched *watched, uint64_t busy, uint64_t now) {
+  int type = watched->_type.load(memory_order_relaxed);
+  log("stall: %s busy for %llums handling %s in room %d for [%d], backtrace follows\n",
+      watched->_name, (unsigned long long)((now - busy) / 1000000),
+      metricTypeName((MessageType)type), watched->_room.load(memory_order_relaxed) + 1,
+      watched->_session.load(memory_order_relaxed));
+  metric(kStalls);
+  pthread_kill(watched->_thread, backtraceSignal);
+}
+
+static void run(uint64_t threshold) {
+  unique_lock<mutex> lock(watchLock);
+  while (!watchStopping) {
+    watchWake.wait_for(lock, chrono::nanoseconds(threshold / 4));
+    uint64_t now = metricNow();
+    for (Watched *watched = allWatched.load(); watched != nullptr; watched = watched->_next) {
+      uint64_t busy = watched->_busy.load(memory_order_relaxed);
+      if (busy != 0 && now > busy + threshold && busy != watched->_reported) {
+        // once for each piece of work
+        watched->_reported = busy;
+        report(watched, busy, now);
+      }
+    }
+  }
+}
+
+void watchStart(uint64_t threshold) {
+  // the first backtrace loads libgcc, which is best not done in a signal handler
+  void *frames[1];
+  backtrace(frames, 1);
+  signal(backtraceSignal, backtrace_handler);
+  watchStopping = false;
+  watchdog = thread(run, threshold);
+}
+
+void watchStop() {
+  {
+    lock_guard<mutex> lock(watchLock);
+    watchStopping = true;
+    watchWake.notify_one();
+  }
+  if (watchdog.joinable()) {
+    watchdog.join();
+  }
+}
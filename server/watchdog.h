@@ -0,0 +1,34 @@
+//
+// Kibitzer web-sockets server
+//
+// Copyright(C) 2020 Chris Warren-Smith.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include "message.h"
+
+//
+// the service and shard threads stamp the time they start on a piece of work and clear
+// it when done. a watchdog thread reports any thread still busy with the same work after
+// the threshold, logging what it was handling and its backtrace, and counting the stall
+//
+
+// registers the calling thread's loop with the watchdog
+void watchThread(const char *name);
+
+// notes what the calling thread is working on, for the report
+void watchWork(MessageType type, int room, int sessionId);
+
+// starts the watchdog, reporting work taking longer than threshold nanoseconds
+void watchStart(uint64_t threshold);
+
+// stops and joins the watchdog
+void watchStop();
+
+// marks the calling thread busy until the end of the enclosing block
+struct WatchBusy {
+  WatchBusy();
+  ~WatchBusy();
+};